@@ -26,6 +26,17 @@
 
 #define MALLOC(n)   xmalloc(n)
 
+/* fast_strtod.c provides fpconv_strtod() and falls back to dtoa.c
+ * for inputs it cannot convert exactly */
+#ifdef USE_FAST_STRTOD
+#define fpconv_strtod   dtoa_strtod
+#endif
+
+/* dtoa.c has no way to report an allocation failure. Its Bigints are
+ * bounded by the range of a double and are normally served from a
+ * small private pool, so failing here means the process has run out of
+ * memory. Raising a Lua error instead is not safe: it would unwind past
+ * the dtoa locks with MULTIPLE_THREADS. */
 static void *xmalloc(size_t size)
 {
     void *p;
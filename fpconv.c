@@ -35,6 +35,12 @@
 
 #include "fpconv.h"
 
+/* grisu.c provides fpconv_g_fmt(), and uses this version when it
+ * cannot round exactly */
+#ifdef USE_GRISU_G_FMT
+#define fpconv_g_fmt    exact_g_fmt
+#endif
+
 /* Lua CJSON assumes the locale is the same for all threads within a
  * process and doesn't change after initialisation.
  *
@@ -123,11 +129,13 @@ double fpconv_strtod(const char *nptr, char **endptr)
 
     /* Duplicate number into buffer */
     if (buflen >= FPCONV_G_FMT_BUFSIZE) {
-        /* Handle unusually large numbers */
+        /* Handle unusually large numbers. If the copy cannot be
+         * allocated, report that no number was found rather than
+         * aborting the process. */
         buf = (char *)malloc(buflen + 1);
         if (!buf) {
-            fprintf(stderr, "Out of memory");
-            abort();
+            *endptr = (char *)nptr;
+            return 0;
         }
     } else {
         /* This is the common case.. */
@@ -154,7 +162,7 @@ static void set_number_format(char *fmt, int precision)
 {
     int d1, d2, i;
 
-    assert(1 <= precision && precision <= 14);
+    assert(1 <= precision && precision <= 17);
 
     /* Create printf format (%.14g) from precision */
     d1 = precision / 10;
@@ -2,8 +2,8 @@
 
 /* Buffer required to store the largest string representation of a double.
  *
- * Longest double printed with %.14g is 21 characters long:
- * -1.7976931348623e+308 */
+ * Longest double printed with %.17g is 24 characters long:
+ * -1.7976931348623157e+308 */
 # define FPCONV_G_FMT_BUFSIZE   32
 
 #ifdef USE_INTERNAL_FPCONV
@@ -18,5 +18,10 @@ extern void fpconv_init();
 extern int fpconv_g_fmt(char*, double, int);
 extern double fpconv_strtod(const char*, char**);
 
+#ifdef USE_GRISU_G_FMT
+/* Exact fpconv_g_fmt() from fpconv.c or g_fmt.c, used by grisu.c */
+extern int exact_g_fmt(char*, double, int);
+#endif
+
 /* vi:ai et sw=4 ts=4:
  */
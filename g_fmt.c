@@ -32,6 +32,11 @@ extern "C" {
 	}
 #endif
 
+/* grisu.c provides fpconv_g_fmt() with USE_GRISU_G_FMT */
+#ifdef USE_GRISU_G_FMT
+#define fpconv_g_fmt exact_g_fmt
+#endif
+
 int
 fpconv_g_fmt(char *b, double x, int precision)
 {
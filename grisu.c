@@ -0,0 +1,437 @@
+/* grisu - Shortest round trip double to text conversion
+ *
+ * Copyright (c) 2026  Lua CJSON contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * cached_power(), grisu_round() and digit_gen() are adapted from Milo
+ * Yip's Grisu2 implementation in RapidJSON (include/rapidjson/internal/
+ * dtoa.h), which carries the following notice:
+ *
+ * Tencent is pleased to support the open source community by making
+ * RapidJSON available.
+ *
+ * Copyright (C) 2015 THL A29 Limited, a Tencent company, and Milo Yip.
+ *
+ * Licensed under the MIT License (the "License"); you may not use this
+ * file except in compliance with the License. You may obtain a copy of
+ * the License at
+ *
+ * http://opensource.org/licenses/MIT
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ * implied. See the License for the specific language governing
+ * permissions and limitations under the License.
+ */
+
+/* fpconv_g_fmt() implemented with Florian Loitsch's Grisu2 algorithm
+ * ("Printing Floating-Point Numbers Quickly and Accurately with
+ * Integers", PLDI 2010).
+ *
+ * Grisu2 generates the digits of a double using 64 bit integer
+ * arithmetic only. The result always converts back to the same double,
+ * and is the shortest such string for the vast majority of values.
+ * Unlike snprintf() and dtoa(), it does not allocate memory or depend on
+ * the locale.
+ *
+ * Numbers are printed like "%.<precision>g", except trailing digits
+ * beyond the shortest representation are never generated. When fewer
+ * digits are requested than Grisu2 generates, the digits are rounded
+ * unless they are too close to halfway to be certain of the result. In
+ * that case the exact_g_fmt() implementation from g_fmt.c
+ * (USE_INTERNAL_FPCONV) or fpconv.c is used.
+ *
+ * Enabled with USE_GRISU_G_FMT. */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "fpconv.h"
+
+#define DP_SIGNIFICAND_MASK 0x000FFFFFFFFFFFFFULL
+#define DP_HIDDEN_BIT       0x0010000000000000ULL
+#define DP_EXPONENT_BIAS    (0x3FF + 52)
+#define DP_MIN_EXPONENT     (-DP_EXPONENT_BIAS)
+
+/* "Do it yourself" floating point: f * 2^e */
+typedef struct {
+    uint64_t f;
+    int e;
+} diy_fp_t;
+
+/* Normalised 64 bit approximations (rounded) of 10^k, where
+ * k = -348, -340, .., 340. cached_powers_e[] holds the binary exponent. */
+static const uint64_t cached_powers_f[] = {
+    0xFA8FD5A0081C0288ULL, 0xBAAEE17FA23EBF76ULL, 0x8B16FB203055AC76ULL,
+    0xCF42894A5DCE35EAULL, 0x9A6BB0AA55653B2DULL, 0xE61ACF033D1A45DFULL,
+    0xAB70FE17C79AC6CAULL, 0xFF77B1FCBEBCDC4FULL, 0xBE5691EF416BD60CULL,
+    0x8DD01FAD907FFC3CULL, 0xD3515C2831559A83ULL, 0x9D71AC8FADA6C9B5ULL,
+    0xEA9C227723EE8BCBULL, 0xAECC49914078536DULL, 0x823C12795DB6CE57ULL,
+    0xC21094364DFB5637ULL, 0x9096EA6F3848984FULL, 0xD77485CB25823AC7ULL,
+    0xA086CFCD97BF97F4ULL, 0xEF340A98172AACE5ULL, 0xB23867FB2A35B28EULL,
+    0x84C8D4DFD2C63F3BULL, 0xC5DD44271AD3CDBAULL, 0x936B9FCEBB25C996ULL,
+    0xDBAC6C247D62A584ULL, 0xA3AB66580D5FDAF6ULL, 0xF3E2F893DEC3F126ULL,
+    0xB5B5ADA8AAFF80B8ULL, 0x87625F056C7C4A8BULL, 0xC9BCFF6034C13053ULL,
+    0x964E858C91BA2655ULL, 0xDFF9772470297EBDULL, 0xA6DFBD9FB8E5B88FULL,
+    0xF8A95FCF88747D94ULL, 0xB94470938FA89BCFULL, 0x8A08F0F8BF0F156BULL,
+    0xCDB02555653131B6ULL, 0x993FE2C6D07B7FACULL, 0xE45C10C42A2B3B06ULL,
+    0xAA242499697392D3ULL, 0xFD87B5F28300CA0EULL, 0xBCE5086492111AEBULL,
+    0x8CBCCC096F5088CCULL, 0xD1B71758E219652CULL, 0x9C40000000000000ULL,
+    0xE8D4A51000000000ULL, 0xAD78EBC5AC620000ULL, 0x813F3978F8940984ULL,
+    0xC097CE7BC90715B3ULL, 0x8F7E32CE7BEA5C70ULL, 0xD5D238A4ABE98068ULL,
+    0x9F4F2726179A2245ULL, 0xED63A231D4C4FB27ULL, 0xB0DE65388CC8ADA8ULL,
+    0x83C7088E1AAB65DBULL, 0xC45D1DF942711D9AULL, 0x924D692CA61BE758ULL,
+    0xDA01EE641A708DEAULL, 0xA26DA3999AEF774AULL, 0xF209787BB47D6B85ULL,
+    0xB454E4A179DD1877ULL, 0x865B86925B9BC5C2ULL, 0xC83553C5C8965D3DULL,
+    0x952AB45CFA97A0B3ULL, 0xDE469FBD99A05FE3ULL, 0xA59BC234DB398C25ULL,
+    0xF6C69A72A3989F5CULL, 0xB7DCBF5354E9BECEULL, 0x88FCF317F22241E2ULL,
+    0xCC20CE9BD35C78A5ULL, 0x98165AF37B2153DFULL, 0xE2A0B5DC971F303AULL,
+    0xA8D9D1535CE3B396ULL, 0xFB9B7CD9A4A7443CULL, 0xBB764C4CA7A44410ULL,
+    0x8BAB8EEFB6409C1AULL, 0xD01FEF10A657842CULL, 0x9B10A4E5E9913129ULL,
+    0xE7109BFBA19C0C9DULL, 0xAC2820D9623BF429ULL, 0x80444B5E7AA7CF85ULL,
+    0xBF21E44003ACDD2DULL, 0x8E679C2F5E44FF8FULL, 0xD433179D9C8CB841ULL,
+    0x9E19DB92B4E31BA9ULL, 0xEB96BF6EBADF77D9ULL, 0xAF87023B9BF0EE6BULL
+};
+
+static const int16_t cached_powers_e[] = {
+    -1220, -1193, -1166, -1140, -1113, -1087, -1060, -1034, -1007, -980,
+    -954, -927, -901, -874, -847, -821, -794, -768, -741, -715,
+    -688, -661, -635, -608, -582, -555, -529, -502, -475, -449,
+    -422, -396, -369, -343, -316, -289, -263, -236, -210, -183,
+    -157, -130, -103, -77, -50, -24, 3, 30, 56, 83,
+    109, 136, 162, 189, 216, 242, 269, 295, 322, 348,
+    375, 402, 428, 455, 481, 508, 534, 561, 588, 614,
+    641, 667, 694, 720, 747, 774, 800, 827, 853, 880,
+    907, 933, 960, 986, 1013, 1039, 1066
+};
+
+
+static const uint64_t pow10_64[] = {
+    1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL,
+    10000000ULL, 100000000ULL, 1000000000ULL, 10000000000ULL,
+    100000000000ULL, 1000000000000ULL, 10000000000000ULL,
+    100000000000000ULL, 1000000000000000ULL, 10000000000000000ULL,
+    100000000000000000ULL, 1000000000000000000ULL,
+    10000000000000000000ULL
+};
+
+static inline uint64_t double_to_bits(double d)
+{
+    uint64_t bits;
+
+    memcpy(&bits, &d, sizeof(bits));
+    return bits;
+}
+
+/* Product rounded to the upper 64 bits */
+static diy_fp_t diy_fp_multiply(diy_fp_t x, diy_fp_t y)
+{
+    const uint64_t mask_32 = 0xFFFFFFFF;
+    uint64_t a = x.f >> 32, b = x.f & mask_32;
+    uint64_t c = y.f >> 32, d = y.f & mask_32;
+    uint64_t ac = a * c, bc = b * c, ad = a * d, bd = b * d;
+    uint64_t tmp = (bd >> 32) + (ad & mask_32) + (bc & mask_32);
+    diy_fp_t r;
+
+    tmp += 1U << 31;    /* Round */
+    r.f = ac + (ad >> 32) + (bc >> 32) + (tmp >> 32);
+    r.e = x.e + y.e + 64;
+
+    return r;
+}
+
+static diy_fp_t diy_fp_normalize(diy_fp_t v)
+{
+    while (!(v.f & 0x8000000000000000ULL)) {
+        v.f <<= 1;
+        v.e--;
+    }
+
+    return v;
+}
+
+/* Calculate the (normalised) value of the double, and the boundaries
+ * halfway to its neighbours. Any number between the boundaries converts
+ * back to the same double. */
+static void diy_fp_from_double(double d, diy_fp_t *w, diy_fp_t *minus,
+                               diy_fp_t *plus)
+{
+    uint64_t bits = double_to_bits(d);
+    int biased_e = (int)((bits >> 52) & 0x7FF);
+    diy_fp_t v, pl, mi;
+
+    v.f = bits & DP_SIGNIFICAND_MASK;
+    if (biased_e) {
+        v.f += DP_HIDDEN_BIT;
+        v.e = biased_e - DP_EXPONENT_BIAS;
+    } else {
+        v.e = DP_MIN_EXPONENT + 1;     /* Subnormal */
+    }
+
+    pl.f = (v.f << 1) + 1;
+    pl.e = v.e - 1;
+    while (!(pl.f & (DP_HIDDEN_BIT << 1))) {
+        pl.f <<= 1;
+        pl.e--;
+    }
+    pl.f <<= 64 - 52 - 2;
+    pl.e -= 64 - 52 - 2;
+
+    /* The lower boundary is closer for powers of 2 */
+    if (v.f == DP_HIDDEN_BIT) {
+        mi.f = (v.f << 2) - 1;
+        mi.e = v.e - 2;
+    } else {
+        mi.f = (v.f << 1) - 1;
+        mi.e = v.e - 1;
+    }
+    mi.f <<= mi.e - pl.e;
+    mi.e = pl.e;
+
+    *w = diy_fp_normalize(v);
+    *minus = mi;
+    *plus = pl;
+}
+
+/* Find a cached power of 10 which scales a number with binary exponent e
+ * into the range [2^-60, 2^-32]. *k is set to the negated decimal
+ * exponent. */
+static diy_fp_t cached_power(int e, int *k)
+{
+    double dk = (-61 - e) * 0.30102999566398114 + 347;   /* log10(2) */
+    int ik = (int)dk;
+    int index;
+    diy_fp_t r;
+
+    if (dk - ik > 0.0)
+        ik++;
+    index = (ik >> 3) + 1;
+    *k = -(-348 + index * 8);
+
+    r.f = cached_powers_f[index];
+    r.e = cached_powers_e[index];
+    return r;
+}
+
+static int count_digits_32(uint32_t n)
+{
+    int digits = 1;
+
+    while (digits < 10 && n >= pow10_64[digits])
+        digits++;
+
+    return digits;
+}
+
+/* Move the last digit towards w while it remains inside the boundaries */
+static void grisu_round(char *buf, int len, uint64_t delta, uint64_t rest,
+                        uint64_t ten_kappa, uint64_t wp_w)
+{
+    while (rest < wp_w && delta - rest >= ten_kappa &&
+           (rest + ten_kappa < wp_w ||
+            wp_w - rest > rest + ten_kappa - wp_w)) {
+        buf[len - 1]--;
+        rest += ten_kappa;
+    }
+}
+
+/* Generate the shortest digits of mp which stay within delta of it. */
+static int digit_gen(diy_fp_t w, diy_fp_t mp, uint64_t delta,
+                     char *buf, int *k)
+{
+    const diy_fp_t one = { 1ULL << -mp.e, mp.e };
+    const uint64_t wp_w = mp.f - w.f;
+    uint32_t p1 = (uint32_t)(mp.f >> -one.e);
+    uint64_t p2 = mp.f & (one.f - 1);
+    int kappa = count_digits_32(p1);
+    int len = 0;
+    uint64_t rest;
+    uint32_t d;
+
+    while (kappa > 0) {
+        d = (uint32_t)(p1 / pow10_64[kappa - 1]);
+        p1 = (uint32_t)(p1 % pow10_64[kappa - 1]);
+        if (d || len)
+            buf[len++] = '0' + d;
+        kappa--;
+        rest = ((uint64_t)p1 << -one.e) + p2;
+        if (rest <= delta) {
+            *k += kappa;
+            grisu_round(buf, len, delta, rest,
+                        pow10_64[kappa] << -one.e, wp_w);
+            return len;
+        }
+    }
+
+    for (;;) {
+        p2 *= 10;
+        delta *= 10;
+        d = (uint32_t)(p2 >> -one.e);
+        if (d || len)
+            buf[len++] = '0' + d;
+        p2 &= one.f - 1;
+        kappa--;
+        if (p2 < delta) {
+            *k += kappa;
+            grisu_round(buf, len, delta, p2, one.f,
+                        -kappa < 20 ? wp_w * pow10_64[-kappa] : 0);
+            return len;
+        }
+    }
+}
+
+/* Store the digits of a positive, finite, non-zero double in buf.
+ * Returns the number of digits. The value is buf * 10^(*k). */
+static int grisu2(double d, char *buf, int *k)
+{
+    diy_fp_t v, w_m, w_p, c_mk, w, wp, wm;
+
+    diy_fp_from_double(d, &v, &w_m, &w_p);
+    c_mk = cached_power(w_p.e, k);
+    w = diy_fp_multiply(v, c_mk);
+    wp = diy_fp_multiply(w_p, c_mk);
+    wm = diy_fp_multiply(w_m, c_mk);
+    wm.f++;
+    wp.f--;
+
+    return digit_gen(w, wp, wp.f - wm.f, buf, k);
+}
+
+/* Rounding the digits of a nearby decimal may differ from rounding the
+ * exact value of the double when the digits are close to halfway.
+ * Returns true when the result is certain to be the same.
+ *
+ * Grisu2 digits are within half an ULP of a normal double: under 1.2
+ * units of the 16th significant digit, or 12 units of the 17th. */
+static int can_round(const char *digits, int len, int precision)
+{
+    uint64_t tail = 0, halfway;
+    int i;
+
+    for (i = precision; i < len; i++)
+        tail = tail * 10 + (digits[i] - '0');
+    halfway = 5 * pow10_64[len - precision - 1];
+
+    if (len <= 15)
+        return tail != halfway;
+    if (len == 16)
+        return tail + 2 < halfway || halfway + 2 < tail;
+    return tail + 12 < halfway || halfway + 12 < tail;
+}
+
+/* Assumes there is always at least 32 characters available in the target buffer */
+int fpconv_g_fmt(char *str, double num, int precision)
+{
+    char digits[20];
+    uint64_t bits = double_to_bits(num);
+    char *b = str;
+    int len, k, exp10, i;
+
+    if (bits >> 63)
+        *b++ = '-';
+
+    if (((bits >> 52) & 0x7FF) == 0x7FF) {
+        /* Infinity or NaN */
+        memcpy(b, bits & DP_SIGNIFICAND_MASK ? "nan" : "inf", 4);
+        return b + 3 - str;
+    }
+    if (!(bits << 1)) {
+        *b++ = '0';
+        *b = 0;
+        return b - str;
+    }
+
+    len = grisu2(num < 0 ? -num : num, digits, &k);
+    exp10 = len + k - 1;    /* Value is d.ddd * 10^exp10 */
+
+    /* Round to the requested precision */
+    if (len > precision) {
+        if (!(bits >> 52 & 0x7FF) || !can_round(digits, len, precision))
+            return exact_g_fmt(str, num, precision);
+        i = precision;
+        len = precision;
+        if (digits[i] >= '5') {
+            while (i > 0 && digits[i - 1] == '9')
+                i--;
+            if (i > 0) {
+                digits[i - 1]++;
+                len = i;
+            } else {
+                digits[0] = '1';
+                len = 1;
+                exp10++;
+            }
+        }
+    }
+    while (len > 1 && digits[len - 1] == '0')
+        len--;
+
+    if (exp10 < -4 || exp10 >= precision) {
+        /* Exponential notation: d.ddde+XX */
+        *b++ = digits[0];
+        if (len > 1) {
+            *b++ = '.';
+            memcpy(b, digits + 1, len - 1);
+            b += len - 1;
+        }
+        *b++ = 'e';
+        if (exp10 < 0) {
+            *b++ = '-';
+            exp10 = -exp10;
+        } else {
+            *b++ = '+';
+        }
+        if (exp10 >= 100) {
+            *b++ = '0' + exp10 / 100;
+            exp10 %= 100;
+        }
+        *b++ = '0' + exp10 / 10;
+        *b++ = '0' + exp10 % 10;
+    } else if (exp10 < 0) {
+        /* 0.000ddd */
+        *b++ = '0';
+        *b++ = '.';
+        for (i = exp10 + 1; i < 0; i++)
+            *b++ = '0';
+        memcpy(b, digits, len);
+        b += len;
+    } else if (len <= exp10 + 1) {
+        /* ddd000 */
+        memcpy(b, digits, len);
+        b += len;
+        for (i = len; i <= exp10; i++)
+            *b++ = '0';
+    } else {
+        /* ddd.ddd */
+        memcpy(b, digits, exp10 + 1);
+        b += exp10 + 1;
+        *b++ = '.';
+        memcpy(b, digits + exp10 + 1, len - exp10 - 1);
+        b += len - exp10 - 1;
+    }
+    *b = 0;
+
+    return b - str;
+}
+
+/* vi:ai et sw=4 ts=4:
+ */
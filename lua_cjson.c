@@ -40,11 +40,17 @@
 #include <string.h>
 #include <math.h>
 #include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
 #include <lua.h>
 #include <lauxlib.h>
 
 #include "strbuf.h"
 #include "fpconv.h"
+#include "scan.h"
 
 #ifndef CJSON_MODNAME
 #define CJSON_MODNAME   "cjson"
@@ -60,11 +66,26 @@
 #define CJSON_EXPORT    extern
 #endif
 
+/* cjson.decode_file() maps files into memory where mmap() is available */
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
 /* Workaround for Solaris platforms missing isinf() */
 #if !defined(isinf) && (defined(USE_INTERNAL_ISINF) || defined(MISSING_ISINF))
 #define isinf(x) (!isnan(x) && isnan((x) - (x)))
 #endif
 
+/* Lua 5.1 compatibility */
+#if !defined(LUA_VERSION_NUM) || LUA_VERSION_NUM < 502
+#define lua_rawlen(l, i)    lua_objlen(l, i)
+#define lua_getuservalue(l, i)  lua_getfenv(l, i)
+#define lua_setuservalue(l, i)  lua_setfenv(l, i)
+#endif
+
 #define DEFAULT_SPARSE_CONVERT 0
 #define DEFAULT_SPARSE_RATIO 2
 #define DEFAULT_SPARSE_SAFE 10
@@ -73,7 +94,19 @@
 #define DEFAULT_ENCODE_INVALID_NUMBERS 0
 #define DEFAULT_DECODE_INVALID_NUMBERS 1
 #define DEFAULT_ENCODE_KEEP_BUFFER 1
+#define DEFAULT_ENCODE_BUFFER_LIMIT (1024 * 1024)
+#define DEFAULT_ENCODE_BUFFER_CALLS 0
 #define DEFAULT_ENCODE_NUMBER_PRECISION 14
+#define DEFAULT_ENCODE_CHUNK_SIZE 65536
+#define DEFAULT_ENCODE_SEGMENTED 0
+#define DEFAULT_DECODE_TYPE_MARKERS 0
+#define DEFAULT_DECODE_PRESIZE_TABLES 0
+#define DEFAULT_DECODE_KEEP_BUFFER 1
+#define DEFAULT_DECODE_BUFFER_LIMIT (1024 * 1024)
+
+/* Number of nesting levels that track table size hints when
+ * decode_presize_tables is enabled */
+#define DECODE_SIZE_HINT_DEPTH 32
 
 #ifdef DISABLE_INVALID_NUMBERS
 #undef DEFAULT_DECODE_INVALID_NUMBERS
@@ -87,6 +120,7 @@ typedef enum {
     T_ARR_END,
     T_STRING,
     T_NUMBER,
+    T_INTEGER,
     T_BOOLEAN,
     T_NULL,
     T_COLON,
@@ -104,6 +138,7 @@ static const char *json_token_type_name[] = {
     "T_ARR_END",
     "T_STRING",
     "T_NUMBER",
+    "T_INTEGER",
     "T_BOOLEAN",
     "T_NULL",
     "T_COLON",
@@ -115,14 +150,49 @@ static const char *json_token_type_name[] = {
     NULL
 };
 
+/* Table types recorded with cjson.array_mt / cjson.object_mt */
+typedef enum {
+    TABLE_UNMARKED,
+    TABLE_ARRAY,
+    TABLE_OBJECT
+} json_table_marker_t;
+
+/* Output moved out of the encode buffer by a segmented encode */
+typedef struct json_chunk {
+    struct json_chunk *next;
+    char *buf;
+    size_t size;        /* Bytes allocated */
+    size_t length;
+} json_chunk_t;
+
+/* Output sink used by cjson.encode_to(). Segmented encodes use a sink
+ * without a function, which collects chunks instead. */
+typedef struct {
+    strbuf_t *buf;      /* Buffer flushed to the sink, NULL if unused */
+    int func;           /* Stack index of the sink function, 0 for chunks */
+    int self;           /* Stack index of the sink object, 0 if unused */
+    double written;     /* Total bytes written */
+    json_chunk_t *chunks;
+    json_chunk_t *last;
+} json_sink_t;
+
 typedef struct {
     json_token_type_t ch2token[256];
     char escape2char[256];  /* Decoding */
 
+    /* Buffers are allocated with the Lua state's allocator. Kept
+     * buffers only use this copy to be released between calls. While
+     * they grow they refer to the json_call_t of the call using them. */
+    strbuf_alloc_t alloc;
+
     /* encode_buf is only allocated and used when
      * encode_keep_buffer is set */
     strbuf_t encode_buf;
 
+    /* decode_buf is only kept when decode_keep_buffer is set. It is
+     * NULL while a decode is using it. */
+    strbuf_t *decode_buf;
+
     int encode_sparse_convert;
     int encode_sparse_ratio;
     int encode_sparse_safe;
@@ -130,31 +200,79 @@ typedef struct {
     int encode_invalid_numbers;     /* 2 => Encode as "null" */
     int encode_number_precision;
     int encode_keep_buffer;
+    int encode_buffer_limit;    /* Larger buffers are trimmed after use */
+    int encode_buffer_calls;    /* Calls within the limit before trimming */
+    int encode_buffer_idle;     /* Calls within the limit so far */
+    int encode_chunk_size;
+    int encode_segmented;
+    int encode_speculative;     /* Nested sequences are not speculated */
+    int encode_segments;        /* Chunks used by the last segmented encode */
+    int encode_segment_reallocs;    /* Resizes of their buffers */
+
+    /* Active cjson.encode_to() sink. Saved and restored around nested
+     * calls. */
+    json_sink_t encode_sink;
 
     int decode_invalid_numbers;
     int decode_max_depth;
+    int decode_type_markers;
+    int decode_presize_tables;
+    int decode_keep_buffer;
+    int decode_buffer_limit;    /* Larger buffers are trimmed after use */
+
+    /* Element counts of the most recently decoded array / object at
+     * each depth. Used to presize the next table at the same depth. */
+    int decode_array_hint[DECODE_SIZE_HINT_DEPTH];
+    int decode_object_hint[DECODE_SIZE_HINT_DEPTH];
+
+    /* cjson.array_mt / cjson.object_mt. Referenced from the registry. */
+    const void *array_mt;
+    const void *object_mt;
 } json_config_t;
 
+/* Allocators for the buffers of a single call. Failures raise an error
+ * on the thread which made the call, which need not be the last thread
+ * to use the module (eg, a __gc metamethod run during the call).
+ * Temporary buffers use temp_alloc, which releases them first. */
+typedef struct {
+    strbuf_alloc_t alloc;
+    strbuf_alloc_t temp_alloc;
+    json_config_t *cfg;
+    lua_State *l;
+} json_call_t;
+
 typedef struct {
     const char *data;
     const char *ptr;
+    const char *end;  /* End of the JSON text, it need not be terminated */
     strbuf_t *tmp;    /* Temporary storage for strings */
     json_config_t *cfg;
+    json_call_t call;
     int current_depth;
+    int array_mt;     /* Stack index of markers when decode_type_markers */
+    int object_mt;
 } json_parse_t;
 
 typedef struct {
     json_token_type_t type;
-    int index;
+    size_t index;
     union {
         const char *string;
         double number;
+        int64_t integer;
         int boolean;
     } value;
-    int string_len;
+    size_t string_len;
 } json_token_t;
 
-static const char *char2escape[256] = {
+/* Escape sequences are either 2 ("\\n") or 6 ("\\u0000") characters,
+ * so the length is known without scanning the entry. Fixed width entries
+ * are copied with a single fixed size memcpy(). Characters without an
+ * escape are empty. */
+#define ESCAPE_WIDTH 8
+#define escape_length(esc)  ((esc)[1] == 'u' ? 6 : 2)
+
+static const char char2escape[256][ESCAPE_WIDTH] = {
     "\\u0000", "\\u0001", "\\u0002", "\\u0003",
     "\\u0004", "\\u0005", "\\u0006", "\\u0007",
     "\\b", "\\t", "\\n", "\\u000b",
@@ -163,38 +281,41 @@ static const char *char2escape[256] = {
     "\\u0014", "\\u0015", "\\u0016", "\\u0017",
     "\\u0018", "\\u0019", "\\u001a", "\\u001b",
     "\\u001c", "\\u001d", "\\u001e", "\\u001f",
-    NULL, NULL, "\\\"", NULL, NULL, NULL, NULL, NULL,
-    NULL, NULL, NULL, NULL, NULL, NULL, NULL, "\\/",
-    NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
-    NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
-    NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
-    NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
-    NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
-    NULL, NULL, NULL, NULL, "\\\\", NULL, NULL, NULL,
-    NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
-    NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
-    NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
-    NULL, NULL, NULL, NULL, NULL, NULL, NULL, "\\u007f",
-    NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
-    NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
-    NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
-    NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
-    NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
-    NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
-    NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
-    NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
-    NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
-    NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
-    NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
-    NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
-    NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
-    NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
-    NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
-    NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
+    "", "", "\\\"", "", "", "", "", "",
+    "", "", "", "", "", "", "", "\\/",
+    "", "", "", "", "", "", "", "",
+    "", "", "", "", "", "", "", "",
+    "", "", "", "", "", "", "", "",
+    "", "", "", "", "", "", "", "",
+    "", "", "", "", "", "", "", "",
+    "", "", "", "", "\\\\", "", "", "",
+    "", "", "", "", "", "", "", "",
+    "", "", "", "", "", "", "", "",
+    "", "", "", "", "", "", "", "",
+    "", "", "", "", "", "", "", "\\u007f",
+    "", "", "", "", "", "", "", "",
+    "", "", "", "", "", "", "", "",
+    "", "", "", "", "", "", "", "",
+    "", "", "", "", "", "", "", "",
+    "", "", "", "", "", "", "", "",
+    "", "", "", "", "", "", "", "",
+    "", "", "", "", "", "", "", "",
+    "", "", "", "", "", "", "", "",
+    "", "", "", "", "", "", "", "",
+    "", "", "", "", "", "", "", "",
+    "", "", "", "", "", "", "", "",
+    "", "", "", "", "", "", "", "",
+    "", "", "", "", "", "", "", "",
+    "", "", "", "", "", "", "", "",
+    "", "", "", "", "", "", "", "",
+    "", "", "", "", "", "", "", "",
 };
 
 /* ===== CONFIGURATION ===== */
 
+static void json_call_init(json_call_t *call, lua_State *l,
+                           json_config_t *cfg);
+
 static json_config_t *json_fetch_config(lua_State *l)
 {
     json_config_t *cfg;
@@ -230,7 +351,7 @@ static int json_integer_option(lua_State *l, int optindex, int *setting,
     if (!lua_isnil(l, optindex)) {
         value = luaL_checkinteger(l, optindex);
         snprintf(errmsg, sizeof(errmsg), "expected integer between %d and %d", min, max);
-        luaL_argcheck(l, min <= value && value <= max, 1, errmsg);
+        luaL_argcheck(l, min <= value && value <= max, optindex, errmsg);
         *setting = value;
     }
 
@@ -303,28 +424,57 @@ static int json_cfg_encode_number_precision(lua_State *l)
 {
     json_config_t *cfg = json_arg_init(l, 1);
 
-    return json_integer_option(l, 1, &cfg->encode_number_precision, 1, 14);
+    return json_integer_option(l, 1, &cfg->encode_number_precision, 1, 17);
+}
+
+/* Configures the amount of output buffered by cjson.encode_to() before
+ * it is written to the sink */
+static int json_cfg_encode_chunk_size(lua_State *l)
+{
+    json_config_t *cfg = json_arg_init(l, 1);
+
+    return json_integer_option(l, 1, &cfg->encode_chunk_size, 1, INT_MAX);
+}
+
+/* Configures whether cjson.encode() output is collected in chunks of
+ * encode_chunk_size bytes, rather than in a single growing buffer */
+static int json_cfg_encode_segmented(lua_State *l)
+{
+    json_config_t *cfg = json_arg_init(l, 1);
+
+    return json_enum_option(l, 1, &cfg->encode_segmented, NULL, 1);
 }
 
 /* Configures JSON encoding buffer persistence */
 static int json_cfg_encode_keep_buffer(lua_State *l)
 {
-    json_config_t *cfg = json_arg_init(l, 1);
+    json_config_t *cfg = json_arg_init(l, 3);
+    json_call_t call;
     int old_value;
 
     old_value = cfg->encode_keep_buffer;
 
     json_enum_option(l, 1, &cfg->encode_keep_buffer, NULL, 1);
+    /* Restart the count of calls within the limit when the policy
+     * changes. Reading the settings must not affect it. */
+    if (!lua_isnil(l, 2) || !lua_isnil(l, 3))
+        cfg->encode_buffer_idle = 0;
+    json_integer_option(l, 2, &cfg->encode_buffer_limit, 0, INT_MAX);
+    json_integer_option(l, 3, &cfg->encode_buffer_calls, 0, INT_MAX);
 
     /* Init / free the buffer if the setting has changed */
     if (old_value ^ cfg->encode_keep_buffer) {
-        if (cfg->encode_keep_buffer)
-            strbuf_init(&cfg->encode_buf, 0);
-        else
+        if (cfg->encode_keep_buffer) {
+            json_call_init(&call, l, cfg);
+            strbuf_init_alloc(&cfg->encode_buf, 0, &call.alloc);
+        }
+        /* An error may have unwound the last call using it */
+        cfg->encode_buf.alloc = &cfg->alloc;
+        if (!cfg->encode_keep_buffer)
             strbuf_free(&cfg->encode_buf);
     }
 
-    return 1;
+    return 3;
 }
 
 #if defined(DISABLE_INVALID_NUMBERS) && !defined(USE_INTERNAL_FPCONV)
@@ -362,21 +512,183 @@ static int json_cfg_decode_invalid_numbers(lua_State *l)
     return 1;
 }
 
+/* Configures JSON decoding buffer persistence */
+static int json_cfg_decode_keep_buffer(lua_State *l)
+{
+    json_config_t *cfg = json_arg_init(l, 2);
+
+    json_enum_option(l, 1, &cfg->decode_keep_buffer, NULL, 1);
+    json_integer_option(l, 2, &cfg->decode_buffer_limit, 0, INT_MAX);
+
+    /* Free the buffer if the setting has been disabled. The next decode
+     * creates it again once enabled. */
+    if (!cfg->decode_keep_buffer && cfg->decode_buf) {
+        strbuf_free(cfg->decode_buf);
+        cfg->decode_buf = NULL;
+    }
+
+    return 2;
+}
+
+/* Configures whether decoded tables record their JSON type via
+ * cjson.array_mt / cjson.object_mt */
+static int json_cfg_decode_type_markers(lua_State *l)
+{
+    json_config_t *cfg = json_arg_init(l, 1);
+
+    return json_enum_option(l, 1, &cfg->decode_type_markers, NULL, 1);
+}
+
+/* Configures whether decoded tables are presized from the size of
+ * previous tables at the same depth */
+static int json_cfg_decode_presize_tables(lua_State *l)
+{
+    json_config_t *cfg = json_arg_init(l, 1);
+
+    return json_enum_option(l, 1, &cfg->decode_presize_tables, NULL, 1);
+}
+
+/* Push a table describing a kept buffer, or zeroes when there is none */
+static void json_push_buffer_stats(lua_State *l, strbuf_t *s)
+{
+    lua_createtable(l, 0, 3);
+    lua_pushnumber(l, s ? (lua_Number)s->size : 0);
+    lua_setfield(l, -2, "size");
+    lua_pushnumber(l, s ? (lua_Number)s->peak : 0);
+    lua_setfield(l, -2, "peak");
+    lua_pushinteger(l, s ? s->reallocs : 0);
+    lua_setfield(l, -2, "reallocs");
+}
+
+/* Returns the size, peak size and resize count of the kept encode and
+ * decode buffers, and the chunks used by the last segmented encode */
+static int json_buffer_stats(lua_State *l)
+{
+    json_config_t *cfg = json_arg_init(l, 0);
+
+    lua_createtable(l, 0, 3);
+    json_push_buffer_stats(l, cfg->encode_keep_buffer ?
+                              &cfg->encode_buf : NULL);
+    lua_setfield(l, -2, "encode");
+    json_push_buffer_stats(l, cfg->decode_buf);
+    lua_setfield(l, -2, "decode");
+
+    /* The most recent segmented encode */
+    lua_createtable(l, 0, 2);
+    lua_pushinteger(l, cfg->encode_segments);
+    lua_setfield(l, -2, "chunks");
+    lua_pushinteger(l, cfg->encode_segment_reallocs);
+    lua_setfield(l, -2, "reallocs");
+    lua_setfield(l, -2, "segmented");
+
+    return 1;
+}
+
+/* Shrink a kept buffer so it holds at most "limit" bytes */
+static void json_buffer_trim(strbuf_t *s, int limit)
+{
+    /* strbuf_resize() requires a length of at least 1 */
+    size_t len = limit > 0 ? (size_t)limit : 1;
+
+    if (s->size > len + 1)
+        strbuf_resize(s, len);
+}
+
 static int json_destroy_config(lua_State *l)
 {
     json_config_t *cfg;
 
     cfg = (json_config_t *)lua_touserdata(l, 1);
-    if (cfg)
+    if (cfg) {
+        /* An error may have unwound the last call using it */
+        cfg->encode_buf.alloc = &cfg->alloc;
         strbuf_free(&cfg->encode_buf);
+        if (cfg->decode_buf)
+            strbuf_free(cfg->decode_buf);
+    }
     cfg = NULL;
 
     return 0;
 }
 
-static void json_create_config(lua_State *l)
+/* Release the chunks of a segmented encode */
+static void json_chunks_free(json_config_t *cfg)
+{
+    strbuf_alloc_t *alloc = &cfg->alloc;
+    json_chunk_t *chunk;
+
+    while ((chunk = cfg->encode_sink.chunks)) {
+        cfg->encode_sink.chunks = chunk->next;
+        alloc->alloc(alloc->ud, chunk->buf, chunk->size, 0);
+        alloc->alloc(alloc->ud, chunk, sizeof(*chunk), 0);
+    }
+    cfg->encode_sink.last = NULL;
+}
+
+/* Forget the state of an encode which is being abandoned. Callers
+ * which run a sink restore their own state after its lua_pcall(). */
+static void json_encode_reset(json_config_t *cfg)
+{
+    cfg->encode_sink.buf = NULL;
+    cfg->encode_sink.func = 0;
+    cfg->encode_sink.chunks = NULL;
+    cfg->encode_sink.last = NULL;
+    cfg->encode_speculative = 0;
+}
+
+/* Raise an allocation failure on the thread of the call. A kept buffer
+ * is returned to the config allocator, and disables its setting if it
+ * could not be created. */
+static void json_alloc_error(void *ctx, strbuf_t *s)
+{
+    json_call_t *call = (json_call_t *)ctx;
+    json_config_t *cfg = call->cfg;
+
+    if (s && s == cfg->encode_sink.buf)
+        json_chunks_free(cfg);
+    json_encode_reset(cfg);
+
+    if (s) {
+        s->alloc = &cfg->alloc;
+        if (s == &cfg->encode_buf && !strbuf_allocated(s))
+            cfg->encode_keep_buffer = 0;
+    }
+
+    luaL_error(call->l, "Out of memory");
+}
+
+/* Temporary buffers are owned by the call being unwound */
+static void json_temp_alloc_error(void *ctx, strbuf_t *s)
+{
+    json_call_t *call = (json_call_t *)ctx;
+
+    if (s) {
+        if (s == call->cfg->encode_sink.buf)
+            json_chunks_free(call->cfg);
+        strbuf_free(s);
+    }
+
+    json_alloc_error(ctx, NULL);
+}
+
+static void json_call_init(json_call_t *call, lua_State *l,
+                           json_config_t *cfg)
+{
+    call->alloc = cfg->alloc;
+    call->alloc.error = json_alloc_error;
+    call->alloc.ctx = call;
+    call->temp_alloc = call->alloc;
+    call->temp_alloc.error = json_temp_alloc_error;
+    call->cfg = cfg;
+    call->l = l;
+}
+
+static json_config_t *json_create_config(lua_State *l)
 {
     json_config_t *cfg;
+#if DEFAULT_ENCODE_KEEP_BUFFER > 0
+    json_call_t call;
+#endif
     int i;
 
     cfg = (json_config_t *)lua_newuserdata(l, sizeof(*cfg));
@@ -395,10 +707,39 @@ static void json_create_config(lua_State *l)
     cfg->encode_invalid_numbers = DEFAULT_ENCODE_INVALID_NUMBERS;
     cfg->decode_invalid_numbers = DEFAULT_DECODE_INVALID_NUMBERS;
     cfg->encode_keep_buffer = DEFAULT_ENCODE_KEEP_BUFFER;
+    cfg->encode_buffer_limit = DEFAULT_ENCODE_BUFFER_LIMIT;
+    cfg->encode_buffer_calls = DEFAULT_ENCODE_BUFFER_CALLS;
+    cfg->encode_buffer_idle = 0;
     cfg->encode_number_precision = DEFAULT_ENCODE_NUMBER_PRECISION;
+    cfg->encode_chunk_size = DEFAULT_ENCODE_CHUNK_SIZE;
+    cfg->encode_segmented = DEFAULT_ENCODE_SEGMENTED;
+    cfg->encode_speculative = 0;
+    cfg->encode_segments = 0;
+    cfg->encode_segment_reallocs = 0;
+    cfg->encode_sink.buf = NULL;
+    cfg->encode_sink.func = 0;
+    cfg->encode_sink.chunks = NULL;
+    cfg->encode_sink.last = NULL;
+    cfg->decode_type_markers = DEFAULT_DECODE_TYPE_MARKERS;
+    cfg->decode_presize_tables = DEFAULT_DECODE_PRESIZE_TABLES;
+    cfg->decode_keep_buffer = DEFAULT_DECODE_KEEP_BUFFER;
+    cfg->decode_buffer_limit = DEFAULT_DECODE_BUFFER_LIMIT;
+    cfg->decode_buf = NULL;
+    for (i = 0; i < DECODE_SIZE_HINT_DEPTH; i++) {
+        cfg->decode_array_hint[i] = 0;
+        cfg->decode_object_hint[i] = 0;
+    }
+    cfg->array_mt = NULL;
+    cfg->object_mt = NULL;
+
+    cfg->alloc.alloc = lua_getallocf(l, &cfg->alloc.ud);
+    cfg->alloc.error = NULL;
+    cfg->alloc.ctx = NULL;
 
 #if DEFAULT_ENCODE_KEEP_BUFFER > 0
-    strbuf_init(&cfg->encode_buf, 0);
+    json_call_init(&call, l, cfg);
+    strbuf_init_alloc(&cfg->encode_buf, 0, &call.alloc);
+    cfg->encode_buf.alloc = &cfg->alloc;
 #endif
 
     /* Decoding init */
@@ -414,7 +755,6 @@ static void json_create_config(lua_State *l)
     cfg->ch2token[']'] = T_ARR_END;
     cfg->ch2token[','] = T_COMMA;
     cfg->ch2token[':'] = T_COLON;
-    cfg->ch2token['\0'] = T_END;
     cfg->ch2token[' '] = T_WHITESPACE;
     cfg->ch2token['\t'] = T_WHITESPACE;
     cfg->ch2token['\n'] = T_WHITESPACE;
@@ -445,15 +785,83 @@ static void json_create_config(lua_State *l)
     cfg->escape2char['f'] = '\f';
     cfg->escape2char['r'] = '\r';
     cfg->escape2char['u'] = 'u';          /* Unicode parsing required */
+
+    return cfg;
+}
+
+/* Registry keys for the type marker metatables. These are shared by all
+ * cjson instances within a Lua state. */
+static char json_array_mt_key;
+static char json_object_mt_key;
+
+/* Push the marker metatable stored at the registry key onto the stack */
+static void json_push_marker(lua_State *l, void *key)
+{
+    lua_pushlightuserdata(l, key);
+    lua_rawget(l, LUA_REGISTRYINDEX);
+}
+
+/* Add the marker metatable to the module table (top of the stack),
+ * creating it if required */
+static const void *json_create_marker(lua_State *l, void *key,
+                                      const char *name)
+{
+    const void *marker;
+
+    json_push_marker(l, key);
+    if (lua_isnil(l, -1)) {
+        lua_pop(l, 1);
+        lua_newtable(l);
+        lua_pushlightuserdata(l, key);
+        lua_pushvalue(l, -2);
+        lua_rawset(l, LUA_REGISTRYINDEX);
+    }
+    marker = lua_topointer(l, -1);
+    lua_setfield(l, -2, name);
+
+    return marker;
 }
 
 /* ===== ENCODING ===== */
 
+/* Free the encode buffer, or return it to the config. A kept buffer
+ * which has grown beyond encode_buffer_limit is trimmed once
+ * encode_buffer_calls encodes in a row have fit within the limit, so a
+ * single large document does not pin memory. */
+static void json_encode_release_buffer(json_config_t *cfg, strbuf_t *json)
+{
+    if (json != &cfg->encode_buf) {
+        strbuf_free(json);
+        return;
+    }
+
+    if (strbuf_length(json) > (size_t)cfg->encode_buffer_limit)
+        cfg->encode_buffer_idle = 0;
+    else
+        cfg->encode_buffer_idle++;
+
+    if (cfg->encode_buffer_idle >= cfg->encode_buffer_calls) {
+        json_buffer_trim(json, cfg->encode_buffer_limit);
+        cfg->encode_buffer_idle = 0;
+    }
+    json->alloc = &cfg->alloc;
+}
+
+/* Release the output of an encode which is being abandoned. The sink
+ * state is cleared so it does not refer to the caller's buffer once
+ * the stack has been unwound. */
+static void json_encode_release(json_config_t *cfg, strbuf_t *json)
+{
+    if (json == cfg->encode_sink.buf)
+        json_chunks_free(cfg);
+    json_encode_release_buffer(cfg, json);
+    json_encode_reset(cfg);
+}
+
 static void json_encode_exception(lua_State *l, json_config_t *cfg, strbuf_t *json, int lindex,
                                   const char *reason)
 {
-    if (!cfg->encode_keep_buffer)
-        strbuf_free(json);
+    json_encode_release(cfg, json);
     luaL_error(l, "Cannot serialise %s: %s",
                   lua_typename(l, lua_type(l, lindex)), reason);
 }
@@ -468,24 +876,49 @@ static void json_append_string(lua_State *l, strbuf_t *json, int lindex)
 {
     const char *escstr;
     const char *str;
+    const char *end;
+    const char *run;
+    const char *limit;
     size_t len;
-    size_t i;
 
     str = lua_tolstring(l, lindex, &len);
+    end = str + len;
 
-    /* Worst case is len * 6 (all unicode escapes).
-     * This buffer is reused constantly for small strings
-     * If there are any excess pages, they won't be hit anyway.
-     * This gains ~5% speedup. */
-    strbuf_ensure_empty_length(json, len * 6 + 2);
+    /* Reserve space for the string without escapes. Each escape
+     * reserves its additional space as it is found, rather than
+     * reserving for the len * 6 worst case (all unicode escapes).
+     *
+     * Invariant: there is always room for the remaining input and the
+     * closing quote. */
+    strbuf_ensure_empty_length(json, len + 2);
 
     strbuf_append_char_unsafe(json, '\"');
-    for (i = 0; i < len; i++) {
-        escstr = char2escape[(unsigned char)str[i]];
-        if (escstr)
-            strbuf_append_string(json, escstr);
-        else
-            strbuf_append_char_unsafe(json, str[i]);
+    while (str < end) {
+        /* Runs between escapes are frequently short. Check a few
+         * characters directly before scanning the rest in bulk. */
+        run = str;
+        limit = end - str > 16 ? str + 16 : end;
+        while (run < limit && !char2escape[(unsigned char)*run][0])
+            run++;
+        if (run == limit)
+            run = scan_escape(run, end);
+
+        if (limit - str == 16 && run < limit) {
+            /* Fixed size copy. The invariant ensures there is room. */
+            memcpy(strbuf_empty_ptr(json), str, 16);
+            strbuf_extend_length(json, run - str);
+        } else {
+            strbuf_append_mem_unsafe(json, str, run - str);
+        }
+        str = run;
+
+        /* Escapes are often adjacent */
+        while (str < end && *(escstr = char2escape[(unsigned char)*str])) {
+            strbuf_ensure_empty_length(json, ESCAPE_WIDTH + (end - str));
+            memcpy(strbuf_empty_ptr(json), escstr, ESCAPE_WIDTH);
+            strbuf_extend_length(json, escape_length(escstr));
+            str++;
+        }
     }
     strbuf_append_char_unsafe(json, '\"');
 }
@@ -553,13 +986,225 @@ static void json_check_encode_depth(lua_State *l, json_config_t *cfg,
     if (current_depth <= cfg->encode_max_depth && lua_checkstack(l, 3))
         return;
 
-    if (!cfg->encode_keep_buffer)
-        strbuf_free(json);
+    json_encode_release(cfg, json);
 
     luaL_error(l, "Cannot serialise, excessive nesting (%d)",
                current_depth);
 }
 
+/* Segmented encodes write to a private buffer with room for a chunk
+ * and the value which crosses the chunk size. Chunks are normally
+ * pushed before the buffer fills. It still grows exponentially when a
+ * single string or number is larger. */
+static void json_chunk_buffer_init(json_config_t *cfg, strbuf_t *json,
+                                   strbuf_alloc_t *alloc)
+{
+    strbuf_init_alloc(json, (size_t)cfg->encode_chunk_size * 2, alloc);
+}
+
+/* Start a segmented encode into "json", using the temporary allocator
+ * of the call */
+static void json_chunks_open(json_config_t *cfg, strbuf_t *json,
+                             json_call_t *call)
+{
+    json_chunk_buffer_init(cfg, json, &call->temp_alloc);
+    cfg->encode_segments = 1;
+    cfg->encode_segment_reallocs = 0;
+
+    cfg->encode_sink.buf = json;
+    cfg->encode_sink.func = 0;
+    cfg->encode_sink.self = 0;
+    cfg->encode_sink.written = 0;
+    cfg->encode_sink.chunks = NULL;
+    cfg->encode_sink.last = NULL;
+}
+
+/* Move the buffered output into a new chunk without copying it. The
+ * buffer is shrunk to fit, which does not normally move it, and is
+ * replaced. */
+static void json_chunk_push(json_config_t *cfg, strbuf_t *json)
+{
+    strbuf_alloc_t *alloc = &cfg->alloc;
+    json_chunk_t *chunk;
+    char *buf;
+
+    chunk = (json_chunk_t *)alloc->alloc(alloc->ud, NULL, 0, sizeof(*chunk));
+    if (!chunk)
+        json_temp_alloc_error(json->alloc->ctx, json);
+
+    chunk->next = NULL;
+    chunk->buf = json->buf;
+    chunk->size = json->size;
+    chunk->length = strbuf_length(json);
+    buf = (char *)alloc->alloc(alloc->ud, chunk->buf, chunk->size,
+                               chunk->length);
+    if (buf) {
+        chunk->buf = buf;
+        chunk->size = chunk->length;
+    }
+
+    if (cfg->encode_sink.last)
+        cfg->encode_sink.last->next = chunk;
+    else
+        cfg->encode_sink.chunks = chunk;
+    cfg->encode_sink.last = chunk;
+    cfg->encode_sink.written += chunk->length;
+    cfg->encode_segments++;
+    cfg->encode_segment_reallocs += json->reallocs;
+
+    json_chunk_buffer_init(cfg, json, json->alloc);
+}
+
+/* Copy the chunks of a segmented encode in front of the output left in
+ * "json", which is grown once to the total length. Each chunk is
+ * released once it has been copied. */
+static void json_chunks_join(json_config_t *cfg, strbuf_t *json)
+{
+    strbuf_alloc_t *alloc = &cfg->alloc;
+    json_chunk_t *chunk;
+    size_t length, total;
+    char *p;
+
+    if (json != cfg->encode_sink.buf)
+        return;
+    if (!cfg->encode_sink.chunks) {
+        cfg->encode_segment_reallocs += json->reallocs;
+        return;
+    }
+
+    length = strbuf_length(json);
+    total = length;
+    for (chunk = cfg->encode_sink.chunks; chunk; chunk = chunk->next)
+        total += chunk->length;
+
+    strbuf_ensure_empty_length(json, total - length);
+    p = strbuf_string(json, NULL);
+    memmove(p + total - length, p, length);
+
+    while ((chunk = cfg->encode_sink.chunks)) {
+        memcpy(p, chunk->buf, chunk->length);
+        p += chunk->length;
+        cfg->encode_sink.chunks = chunk->next;
+        alloc->alloc(alloc->ud, chunk->buf, chunk->size, 0);
+        alloc->alloc(alloc->ud, chunk, sizeof(*chunk), 0);
+    }
+    cfg->encode_sink.last = NULL;
+
+    strbuf_set_length(json, total);
+    cfg->encode_segment_reallocs += json->reallocs;
+}
+
+/* Total length of the output, including chunks */
+static inline size_t json_output_length(json_config_t *cfg, strbuf_t *json)
+{
+    size_t length = strbuf_length(json);
+
+    if (json == cfg->encode_sink.buf)
+        length += (size_t)cfg->encode_sink.written;
+
+    return length;
+}
+
+/* Discard the output after "pos". Output written to a sink function
+ * cannot be discarded, but chunks can. */
+static void json_output_truncate(json_config_t *cfg, strbuf_t *json,
+                                 size_t pos)
+{
+    strbuf_alloc_t *alloc = &cfg->alloc;
+    json_chunk_t **link = &cfg->encode_sink.chunks;
+    json_chunk_t *chunk, *last = NULL;
+    size_t offset = 0;
+
+    if (json != cfg->encode_sink.buf) {
+        strbuf_set_length(json, pos);
+        return;
+    }
+
+    if (pos >= (size_t)cfg->encode_sink.written) {
+        strbuf_set_length(json, pos - (size_t)cfg->encode_sink.written);
+        return;
+    }
+
+    /* Keep the chunks before "pos", and the start of the chunk
+     * containing it */
+    while (*link && offset + (*link)->length <= pos) {
+        offset += (*link)->length;
+        last = *link;
+        link = &last->next;
+    }
+    if (offset < pos) {
+        (*link)->length = pos - offset;
+        last = *link;
+        link = &last->next;
+    }
+
+    while ((chunk = *link)) {
+        *link = chunk->next;
+        alloc->alloc(alloc->ud, chunk->buf, chunk->size, 0);
+        alloc->alloc(alloc->ud, chunk, sizeof(*chunk), 0);
+    }
+    cfg->encode_sink.last = last;
+    cfg->encode_sink.written = pos;
+    strbuf_reset(json);
+}
+
+/* Write the buffered output to the cjson.encode_to() sink.
+ *
+ * Sinks are called as sink(chunk) or sink:write(chunk). A sink reports
+ * failure by returning nil and an error message (eg, file handles). */
+static void json_sink_write(lua_State *l, json_config_t *cfg, strbuf_t *json)
+{
+    json_sink_t sink = cfg->encode_sink;
+    const char *chunk;
+    size_t len;
+    int nargs;
+
+    if (!sink.func) {
+        json_chunk_push(cfg, json);
+        return;
+    }
+
+    if (!lua_checkstack(l, 3)) {
+        json_encode_release(cfg, json);
+        luaL_error(l, "Cannot write to sink: stack overflow");
+    }
+
+    chunk = strbuf_string(json, &len);
+    lua_pushvalue(l, sink.func);
+    nargs = 1;
+    if (sink.self) {
+        lua_pushvalue(l, sink.self);
+        nargs++;
+    }
+    lua_pushlstring(l, chunk, len);
+    strbuf_reset(json);
+
+    /* The sink may encode other values with this module */
+    cfg->encode_sink.buf = NULL;
+    if (lua_pcall(l, nargs, 2, 0) != 0) {
+        json_encode_release(cfg, json);
+        lua_error(l);
+    }
+    cfg->encode_sink = sink;
+    cfg->encode_sink.written += len;
+
+    if (lua_isnil(l, -2) && !lua_isnil(l, -1)) {
+        json_encode_release(cfg, json);
+        luaL_error(l, "Cannot write to sink: %s",
+                   lua_isstring(l, -1) ? lua_tostring(l, -1) : "unknown error");
+    }
+    lua_pop(l, 2);
+}
+
+/* Flush once a chunk of output is available when encoding to a sink */
+static inline void json_sink_check(lua_State *l, json_config_t *cfg,
+                                   strbuf_t *json)
+{
+    if (json == cfg->encode_sink.buf &&
+        strbuf_length(json) >= (size_t)cfg->encode_chunk_size)
+        json_sink_write(l, cfg, json);
+}
+
 static void json_append_data(lua_State *l, json_config_t *cfg,
                              int current_depth, strbuf_t *json);
 
@@ -584,17 +1229,151 @@ static void json_append_array(lua_State *l, json_config_t *cfg, int current_dept
         lua_rawgeti(l, -1, i);
         json_append_data(l, cfg, current_depth, json);
         lua_pop(l, 1);
+
+        json_sink_check(l, cfg, json);
+    }
+
+    strbuf_append_char(json, ']');
+}
+
+/* Encode the table on the top of the stack if it is a sequence (only
+ * keys 1..n). Lua traverses the array part in order, so most arrays can
+ * be verified and encoded with a single lua_next() pass without a
+ * separate lua_array_length() scan.
+ *
+ * Returns 0 and leaves the JSON buffer unchanged if the table may
+ * contain other keys. When output had to be discarded,
+ * encode_speculative is left set and the caller clears it once the
+ * table has been encoded another way. */
+static int json_append_sequence(lua_State *l, json_config_t *cfg,
+                                int current_depth, strbuf_t *json)
+{
+    size_t start;
+    int length, i;
+
+    length = lua_rawlen(l, -1);
+    if (length <= 0)
+        return 0;
+
+    /* Quickly reject tables with keys stored after the border */
+    lua_pushinteger(l, length);
+    if (lua_next(l, -2) != 0) {
+        lua_pop(l, 2);
+        return 0;
+    }
+
+    start = json_output_length(cfg, json);
+    strbuf_append_char(json, '[');
+
+    /* Nested tables are encoded directly while this table may still be
+     * discarded, and while it is re-encoded after a discard. Otherwise
+     * each level could repeat the work of the levels below it. */
+    cfg->encode_speculative = 1;
+
+    i = 0;
+    lua_pushnil(l);
+    /* table, startkey */
+    while (lua_next(l, -2) != 0) {
+        /* table, key, value */
+        i++;
+        if (lua_type(l, -2) != LUA_TNUMBER || lua_tonumber(l, -2) != i) {
+            /* Out of order, or not an array. Discard the output. */
+            lua_pop(l, 2);
+            json_output_truncate(cfg, json, start);
+            return 0;
+        }
+
+        if (i > 1)
+            strbuf_append_char(json, ',');
+        json_append_data(l, cfg, current_depth, json);
+        lua_pop(l, 1);
+
+        /* Chunks can still be truncated if the table is discarded */
+        json_sink_check(l, cfg, json);
     }
 
     strbuf_append_char(json, ']');
+    cfg->encode_speculative = 0;
+
+    return 1;
+}
+
+/* Writes the decimal representation of value to buf (which must hold at
+ * least 20 characters) two digits at a time. Returns the length. */
+static int json_integer_to_str(char *buf, int64_t value)
+{
+    static const char digit_pairs[] =
+        "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+        "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+        "8081828384858687888990919293949596979899";
+    char tmp[20];
+    char *p = tmp + sizeof(tmp);
+    uint64_t n = value < 0 ? 0 - (uint64_t)value : (uint64_t)value;
+    const char *pair;
+    int len;
+
+    while (n >= 100) {
+        pair = &digit_pairs[(n % 100) * 2];
+        n /= 100;
+        *--p = pair[1];
+        *--p = pair[0];
+    }
+    if (n >= 10) {
+        pair = &digit_pairs[n * 2];
+        *--p = pair[1];
+        *--p = pair[0];
+    } else {
+        *--p = '0' + (char)n;
+    }
+    if (value < 0)
+        *--p = '-';
+
+    len = tmp + sizeof(tmp) - p;
+    memcpy(buf, p, len);
+
+    return len;
+}
+
+static void json_append_integer(strbuf_t *json, int64_t value)
+{
+    int len;
+
+    strbuf_ensure_empty_length(json, FPCONV_G_FMT_BUFSIZE);
+    len = json_integer_to_str(strbuf_empty_ptr(json), value);
+    strbuf_extend_length(json, len);
 }
 
 static void json_append_number(lua_State *l, json_config_t *cfg,
                                strbuf_t *json, int lindex)
 {
-    double num = lua_tonumber(l, lindex);
+    static const double precision_limit[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17
+    };
+    double num;
+    int64_t inum;
     int len;
 
+#if LUA_VERSION_NUM >= 503
+    if (lua_isinteger(l, lindex)) {
+        json_append_integer(json, (int64_t)lua_tointeger(l, lindex));
+        return;
+    }
+#endif
+
+    num = lua_tonumber(l, lindex);
+
+    /* Integral values which fit within the precision are printed
+     * identically by "%.14g". Negative zero must keep its sign. */
+    if (-precision_limit[cfg->encode_number_precision] < num &&
+        num < precision_limit[cfg->encode_number_precision]) {
+        inum = (int64_t)num;
+        if (inum == num && (inum || 1 / num > 0)) {
+            json_append_integer(json, inum);
+            return;
+        }
+    }
+
     if (cfg->encode_invalid_numbers == 0) {
         /* Prevent encoding invalid numbers */
         if (isinf(num) || isnan(num))
@@ -663,16 +1442,37 @@ static void json_append_object(lua_State *l, json_config_t *cfg,
         json_append_data(l, cfg, current_depth, json);
         lua_pop(l, 1);
         /* table, key */
+
+        json_sink_check(l, cfg, json);
     }
 
     strbuf_append_char(json, '}');
 }
 
+/* Find whether the table on the top of the stack has been marked as an
+ * array or object */
+static json_table_marker_t json_table_marker(lua_State *l, json_config_t *cfg)
+{
+    const void *mt;
+
+    if (!lua_getmetatable(l, -1))
+        return TABLE_UNMARKED;
+    mt = lua_topointer(l, -1);
+    lua_pop(l, 1);
+
+    if (mt == cfg->array_mt)
+        return TABLE_ARRAY;
+    if (mt == cfg->object_mt)
+        return TABLE_OBJECT;
+
+    return TABLE_UNMARKED;
+}
+
 /* Serialise Lua data into JSON string. */
 static void json_append_data(lua_State *l, json_config_t *cfg,
                              int current_depth, strbuf_t *json)
 {
-    int len;
+    int len, speculated;
 
     switch (lua_type(l, -1)) {
     case LUA_TSTRING:
@@ -690,11 +1490,34 @@ static void json_append_data(lua_State *l, json_config_t *cfg,
     case LUA_TTABLE:
         current_depth++;
         json_check_encode_depth(l, cfg, current_depth, json);
+        /* Marked tables are trusted without inspecting their keys */
+        switch (json_table_marker(l, cfg)) {
+        case TABLE_ARRAY:
+            json_append_array(l, cfg, current_depth, json, lua_rawlen(l, -1));
+            return;
+        case TABLE_OBJECT:
+            json_append_object(l, cfg, current_depth, json);
+            return;
+        default:
+            break;
+        }
+        /* Sequences are encoded speculatively and may discard output.
+         * This is not possible once output has been written to a sink
+         * function, or within a table which is being speculated. */
+        speculated = 0;
+        if (!cfg->encode_speculative &&
+            (json != cfg->encode_sink.buf || !cfg->encode_sink.func)) {
+            if (json_append_sequence(l, cfg, current_depth, json))
+                break;
+            speculated = cfg->encode_speculative;
+        }
         len = lua_array_length(l, cfg, json);
         if (len > 0)
             json_append_array(l, cfg, current_depth, json, len);
         else
             json_append_object(l, cfg, current_depth, json);
+        if (speculated)
+            cfg->encode_speculative = 0;
         break;
     case LUA_TNIL:
         strbuf_append_mem(json, "null", 4);
@@ -715,30 +1538,168 @@ static void json_append_data(lua_State *l, json_config_t *cfg,
 static int json_encode(lua_State *l)
 {
     json_config_t *cfg = json_fetch_config(l);
+    json_call_t call;
     strbuf_t local_encode_buf;
     strbuf_t *encode_buf;
+    json_sink_t prev_sink;
     char *json;
-    int len;
+    size_t len;
 
     luaL_argcheck(l, lua_gettop(l) == 1, 1, "expected 1 argument");
+    json_call_init(&call, l, cfg);
 
-    if (!cfg->encode_keep_buffer) {
+    /* Nested calls from a sink must not flush to it */
+    prev_sink = cfg->encode_sink;
+    cfg->encode_sink.buf = NULL;
+
+    if (cfg->encode_segmented) {
+        /* Collect chunks in a private buffer */
+        encode_buf = &local_encode_buf;
+        json_chunks_open(cfg, encode_buf, &call);
+    } else if (!cfg->encode_keep_buffer) {
         /* Use private buffer */
         encode_buf = &local_encode_buf;
-        strbuf_init(encode_buf, 0);
+        strbuf_init_alloc(encode_buf, 0, &call.temp_alloc);
     } else {
         /* Reuse existing buffer */
         encode_buf = &cfg->encode_buf;
+        encode_buf->alloc = &call.alloc;
         strbuf_reset(encode_buf);
     }
 
     json_append_data(l, cfg, 0, encode_buf);
+    json_chunks_join(cfg, encode_buf);
     json = strbuf_string(encode_buf, &len);
 
     lua_pushlstring(l, json, len);
 
-    if (!cfg->encode_keep_buffer)
-        strbuf_free(encode_buf);
+    json_encode_release_buffer(cfg, encode_buf);
+
+    cfg->encode_sink = prev_sink;
+
+    return 1;
+}
+
+/* Make the sink at "index" the active cjson.encode_to() sink. The sink
+ * function is pushed onto the stack. The caller must set the buffer. */
+static void json_sink_open(lua_State *l, json_config_t *cfg, int index)
+{
+    cfg->encode_sink.buf = NULL;
+    cfg->encode_sink.self = 0;
+    cfg->encode_sink.written = 0;
+    cfg->encode_sink.chunks = NULL;
+    cfg->encode_sink.last = NULL;
+    if (lua_isfunction(l, index)) {
+        lua_pushvalue(l, index);
+    } else {
+        if (lua_istable(l, index) || lua_isuserdata(l, index))
+            lua_getfield(l, index, "write");
+        else
+            lua_pushnil(l);
+        luaL_argcheck(l, lua_isfunction(l, -1), index,
+                      "expected function or object with write method");
+        cfg->encode_sink.self = index;
+    }
+    cfg->encode_sink.func = lua_gettop(l);
+}
+
+/* Encode a value, writing the output to a sink in chunks of
+ * encode_chunk_size bytes. Returns the number of bytes written. */
+static int json_encode_to(lua_State *l)
+{
+    json_config_t *cfg = json_fetch_config(l);
+    json_call_t call;
+    json_sink_t prev_sink;
+    strbuf_t encode_buf;
+    double written;
+
+    luaL_argcheck(l, lua_gettop(l) == 2, 1, "expected 2 arguments");
+    json_call_init(&call, l, cfg);
+
+    /* Stack: value, sink, sink function */
+    prev_sink = cfg->encode_sink;
+    json_sink_open(l, cfg, 2);
+    lua_pushvalue(l, 1);
+
+    /* Output is kept in a private buffer since the sink may call
+     * cjson.encode() */
+    strbuf_init_alloc(&encode_buf, 0, &call.temp_alloc);
+    cfg->encode_sink.buf = &encode_buf;
+
+    json_append_data(l, cfg, 0, &encode_buf);
+    if (strbuf_length(&encode_buf) > 0)
+        json_sink_write(l, cfg, &encode_buf);
+
+    written = cfg->encode_sink.written;
+    cfg->encode_sink = prev_sink;
+    strbuf_free(&encode_buf);
+
+    lua_pushnumber(l, written);
+
+    return 1;
+}
+
+/* Encode each element of an array followed by a newline (newline
+ * delimited JSON). Returns the combined string, or writes it to the
+ * sink and returns the number of bytes written. */
+static int json_encode_lines(lua_State *l)
+{
+    json_config_t *cfg = json_fetch_config(l);
+    json_call_t call;
+    json_sink_t prev_sink;
+    strbuf_t local_encode_buf;
+    strbuf_t *encode_buf;
+    char *json;
+    size_t len;
+    int count, i;
+
+    luaL_argcheck(l, lua_gettop(l) <= 2, 3, "found too many arguments");
+    luaL_checktype(l, 1, LUA_TTABLE);
+    count = lua_rawlen(l, 1);
+    json_call_init(&call, l, cfg);
+
+    prev_sink = cfg->encode_sink;
+    cfg->encode_sink.buf = NULL;
+
+    if (!lua_isnoneornil(l, 2)) {
+        json_sink_open(l, cfg, 2);
+        encode_buf = &local_encode_buf;
+        strbuf_init_alloc(encode_buf, 0, &call.temp_alloc);
+        cfg->encode_sink.buf = encode_buf;
+    } else if (cfg->encode_segmented) {
+        encode_buf = &local_encode_buf;
+        json_chunks_open(cfg, encode_buf, &call);
+    } else if (!cfg->encode_keep_buffer) {
+        encode_buf = &local_encode_buf;
+        strbuf_init_alloc(encode_buf, 0, &call.temp_alloc);
+    } else {
+        encode_buf = &cfg->encode_buf;
+        encode_buf->alloc = &call.alloc;
+        strbuf_reset(encode_buf);
+    }
+
+    for (i = 1; i <= count; i++) {
+        lua_rawgeti(l, 1, i);
+        json_append_data(l, cfg, 0, encode_buf);
+        lua_pop(l, 1);
+        strbuf_append_char(encode_buf, '\n');
+
+        json_sink_check(l, cfg, encode_buf);
+    }
+
+    if (cfg->encode_sink.buf && cfg->encode_sink.func) {
+        if (strbuf_length(encode_buf) > 0)
+            json_sink_write(l, cfg, encode_buf);
+        lua_pushnumber(l, cfg->encode_sink.written);
+    } else {
+        json_chunks_join(cfg, encode_buf);
+        json = strbuf_string(encode_buf, &len);
+        lua_pushlstring(l, json, len);
+    }
+
+    json_encode_release_buffer(cfg, encode_buf);
+
+    cfg->encode_sink = prev_sink;
 
     return 1;
 }
@@ -837,6 +1798,8 @@ static int json_append_unicode_escape(json_parse_t *json)
     int escape_len = 6;
 
     /* Fetch UTF-16 code unit */
+    if (json->end - json->ptr < escape_len)
+        return -1;
     codepoint = decode_hex4(json->ptr + 2);
     if (codepoint < 0)
         return -1;
@@ -853,7 +1816,8 @@ static int json_append_unicode_escape(json_parse_t *json)
             return -1;
 
         /* Ensure the next code is a unicode escape */
-        if (*(json->ptr + escape_len) != '\\' ||
+        if (json->end - json->ptr < escape_len * 2 ||
+            *(json->ptr + escape_len) != '\\' ||
             *(json->ptr + escape_len + 1) != 'u') {
             return -1;
         }
@@ -880,7 +1844,7 @@ static int json_append_unicode_escape(json_parse_t *json)
         return -1;
 
     /* Append bytes and advance parse index */
-    strbuf_append_mem_unsafe(json->tmp, utf8, len);
+    strbuf_append_mem(json->tmp, utf8, len);
     json->ptr += escape_len;
 
     return 0;
@@ -897,6 +1861,8 @@ static void json_set_token_error(json_token_t *token, json_parse_t *json,
 static void json_next_string_token(json_parse_t *json, json_token_t *token)
 {
     char *escape2char = json->cfg->escape2char;
+    const char *end = json->end;
+    const char *run;
     char ch;
 
     /* Caller must ensure a string is next */
@@ -905,23 +1871,30 @@ static void json_next_string_token(json_parse_t *json, json_token_t *token)
     /* Skip " */
     json->ptr++;
 
+    /* Strings without escapes are returned directly from the JSON
+     * text, avoiding a copy into json->tmp. */
+    run = scan_string(json->ptr, end);
+    if (run < end && *run == '"') {
+        token->type = T_STRING;
+        token->value.string = json->ptr;
+        token->string_len = run - json->ptr;
+        json->ptr = run + 1;
+        return;
+    }
+
     /* json->tmp is the temporary strbuf used to accumulate the
-     * decoded string value.
-     * json->tmp is sized to handle JSON containing only a string value.
+     * decoded string value. It grows on demand so decoding does not
+     * need a second input sized allocation.
      */
     strbuf_reset(json->tmp);
+    strbuf_append_mem(json->tmp, json->ptr, run - json->ptr);
+    json->ptr = run;
 
-    while ((ch = *json->ptr) != '"') {
-        if (!ch) {
-            /* Premature end of the string */
-            json_set_token_error(token, json, "unexpected end of string");
-            return;
-        }
-
+    while (json->ptr < end && (ch = *json->ptr) != '"') {
         /* Handle escapes */
         if (ch == '\\') {
             /* Fetch escape character */
-            ch = *(json->ptr + 1);
+            ch = json->ptr + 1 < end ? *(json->ptr + 1) : '\0';
 
             /* Translate escape code and append to tmp string */
             ch = escape2char[(unsigned char)ch];
@@ -943,8 +1916,19 @@ static void json_next_string_token(json_parse_t *json, json_token_t *token)
         }
         /* Append normal character or translated single character
          * Unicode escapes are handled above */
-        strbuf_append_char_unsafe(json->tmp, ch);
+        strbuf_append_char(json->tmp, ch);
         json->ptr++;
+
+        /* Copy any following plain characters in bulk */
+        run = scan_string(json->ptr, end);
+        strbuf_append_mem(json->tmp, json->ptr, run - json->ptr);
+        json->ptr = run;
+    }
+
+    if (json->ptr == end) {
+        /* Premature end of the string */
+        json_set_token_error(token, json, "unexpected end of string");
+        return;
     }
     json->ptr++;    /* Eat final quote (") */
 
@@ -972,18 +1956,19 @@ static void json_next_string_token(json_parse_t *json, json_token_t *token)
 static int json_is_invalid_number(json_parse_t *json)
 {
     const char *p = json->ptr;
+    const char *end = json->end;
 
     /* Reject numbers starting with + */
     if (*p == '+')
         return 1;
 
     /* Skip minus sign if it exists */
-    if (*p == '-')
-        p++;
+    if (*p == '-' && ++p == end)
+        return 0;
 
     /* Reject numbers starting with 0x, or leading zeros */
     if (*p == '0') {
-        int ch2 = *(p + 1);
+        int ch2 = p + 1 < end ? *(p + 1) : '\0';
 
         if ((ch2 | 0x20) == 'x' ||          /* Hex */
             ('0' <= ch2 && ch2 <= '9'))     /* Leading zero */
@@ -995,6 +1980,8 @@ static int json_is_invalid_number(json_parse_t *json)
     }
 
     /* Reject inf/nan */
+    if (end - p < 3)
+        return 0;
     if (!strncasecmp(p, "inf", 3))
         return 1;
     if (!strncasecmp(p, "nan", 3))
@@ -1005,12 +1992,77 @@ static int json_is_invalid_number(json_parse_t *json)
     return 0;
 }
 
+/* Returns true when strtod() would continue parsing a number at ch */
+static inline int json_is_number_continuation(char ch)
+{
+    return ('0' <= ch && ch <= '9') || ch == '.' ||
+           (ch | 0x20) == 'e' || (ch | 0x20) == 'x';
+}
+
+/* Returns true for whitespace and structural characters. strtod() never
+ * consumes these, so any of them terminates a number. */
+static inline int json_is_delimiter(json_parse_t *json, char ch)
+{
+    json_token_type_t type = json->cfg->ch2token[(unsigned char)ch];
+
+    return type != T_UNKNOWN && type != T_ERROR;
+}
+
+/* strtod() requires a terminated string, but the JSON text may be a
+ * slice of a larger buffer. Numbers which could run up to json->end
+ * are copied into json->tmp first. */
+static double json_strtod(json_parse_t *json, const char **endptr)
+{
+    const char *p = json->ptr;
+    char *tmp_end;
+    double value;
+
+    if (json_is_delimiter(json, *(json->end - 1)))
+        return fpconv_strtod(p, (char **)endptr);
+
+    while (p < json->end && !json_is_delimiter(json, *p))
+        p++;
+    if (p < json->end)
+        return fpconv_strtod(json->ptr, (char **)endptr);
+
+    strbuf_reset(json->tmp);
+    strbuf_append_mem(json->tmp, json->ptr, p - json->ptr);
+    strbuf_ensure_null(json->tmp);
+    value = fpconv_strtod(json->tmp->buf, &tmp_end);
+    *endptr = json->ptr + (tmp_end - json->tmp->buf);
+
+    return value;
+}
+
 static void json_next_number_token(json_parse_t *json, json_token_t *token)
 {
-    char *endptr;
+    const char *p = json->ptr;
+    const char *end = json->end;
+    const char *endptr;
+    int64_t value = 0;
+    int negative = 0;
+    int digits;
+
+    /* Most numbers are plain integers. Convert up to 18 digits inline
+     * since they cannot overflow. Leave anything else (fractions,
+     * exponents, hex, -0, ..) to strtod(). */
+    if (*p == '-') {
+        negative = 1;
+        p++;
+    }
+    for (digits = 0; digits < 18 && p < end && '0' <= *p && *p <= '9'; digits++)
+        value = value * 10 + (*p++ - '0');
+
+    if (digits && (p == end || !json_is_number_continuation(*p)) &&
+        !(negative && !value)) {
+        token->type = T_INTEGER;
+        token->value.integer = negative ? -value : value;
+        json->ptr = p;
+        return;
+    }
 
     token->type = T_NUMBER;
-    token->value.number = fpconv_strtod(json->ptr, &endptr);
+    token->value.number = json_strtod(json, &endptr);
     if (json->ptr == endptr)
         json_set_token_error(token, json, "invalid number");
     else
@@ -1019,6 +2071,12 @@ static void json_next_number_token(json_parse_t *json, json_token_t *token)
     return;
 }
 
+/* Returns true when the remaining input starts with "str" */
+static inline int json_match(json_parse_t *json, const char *str, int len)
+{
+    return json->end - json->ptr >= len && !memcmp(json->ptr, str, len);
+}
+
 /* Fills in the token struct.
  * T_STRING will return a pointer to the json_parse_t temporary string
  * T_ERROR will leave the json->ptr pointer at the error.
@@ -1028,26 +2086,30 @@ static void json_next_token(json_parse_t *json, json_token_t *token)
     const json_token_type_t *ch2token = json->cfg->ch2token;
     int ch;
 
-    /* Eat whitespace. */
-    while (1) {
-        ch = (unsigned char)*(json->ptr);
-        token->type = ch2token[ch];
-        if (token->type != T_WHITESPACE)
-            break;
-        json->ptr++;
+    /* Eat whitespace. Most tokens are not preceded by whitespace, so
+     * only hand over to the scanner when there is some to skip. */
+    if (json->ptr < json->end &&
+        ch2token[(unsigned char)*json->ptr] == T_WHITESPACE) {
+        json->ptr = scan_skip_whitespace(json->ptr + 1, json->end);
     }
 
     /* Store location of new token. Required when throwing errors
      * for unexpected tokens (syntax errors). */
     token->index = json->ptr - json->data;
 
-    /* Don't advance the pointer for an error or the end */
-    if (token->type == T_ERROR) {
-        json_set_token_error(token, json, "invalid token");
+    /* Don't advance the pointer for the end. NULL characters are
+     * invalid tokens since the input length is known. */
+    if (json->ptr == json->end) {
+        token->type = T_END;
         return;
     }
 
-    if (token->type == T_END) {
+    ch = (unsigned char)*json->ptr;
+    token->type = ch2token[ch];
+
+    /* Don't advance the pointer for an error */
+    if (token->type == T_ERROR) {
+        json_set_token_error(token, json, "invalid token");
         return;
     }
 
@@ -1059,7 +2121,7 @@ static void json_next_token(json_parse_t *json, json_token_t *token)
 
     /* Process characters which triggered T_UNKNOWN
      *
-     * Must use strncmp() to match the front of the JSON string.
+     * Must use json_match() to match the front of the JSON string.
      * JSON identifier must be lowercase.
      * When strict_numbers if disabled, either case is allowed for
      * Infinity/NaN (since we are no longer following the spec..) */
@@ -1073,17 +2135,17 @@ static void json_next_token(json_parse_t *json, json_token_t *token)
         }
         json_next_number_token(json, token);
         return;
-    } else if (!strncmp(json->ptr, "true", 4)) {
+    } else if (json_match(json, "true", 4)) {
         token->type = T_BOOLEAN;
         token->value.boolean = 1;
         json->ptr += 4;
         return;
-    } else if (!strncmp(json->ptr, "false", 5)) {
+    } else if (json_match(json, "false", 5)) {
         token->type = T_BOOLEAN;
         token->value.boolean = 0;
         json->ptr += 5;
         return;
-    } else if (!strncmp(json->ptr, "null", 4)) {
+    } else if (json_match(json, "null", 4)) {
         token->type = T_NULL;
         json->ptr += 4;
         return;
@@ -1102,6 +2164,43 @@ static void json_next_token(json_parse_t *json, json_token_t *token)
     json_set_token_error(token, json, "invalid token");
 }
 
+/* Obtain the temporary string buffer used for strings with escapes.
+ * The kept buffer is taken from the config while in use, so a nested
+ * decode, or a decode after an error unwound the previous user, simply
+ * allocates another. */
+static strbuf_t *json_decode_acquire_buffer(json_parse_t *json)
+{
+    json_config_t *cfg = json->cfg;
+    strbuf_t *tmp = cfg->decode_buf;
+
+    if (!tmp)
+        return strbuf_new_alloc(0, &json->call.temp_alloc);
+
+    cfg->decode_buf = NULL;
+    tmp->alloc = &json->call.temp_alloc;
+    strbuf_reset(tmp);
+
+    return tmp;
+}
+
+/* Free the temporary string buffer, or keep it in the config. A kept
+ * buffer which has grown beyond decode_buffer_limit is trimmed so a
+ * single large document does not pin memory. */
+static void json_decode_release_buffer(json_parse_t *json)
+{
+    json_config_t *cfg = json->cfg;
+    strbuf_t *tmp = json->tmp;
+
+    if (!cfg->decode_keep_buffer || cfg->decode_buf) {
+        strbuf_free(tmp);
+        return;
+    }
+
+    json_buffer_trim(tmp, cfg->decode_buffer_limit);
+    tmp->alloc = &cfg->alloc;
+    cfg->decode_buf = tmp;
+}
+
 /* This function does not return.
  * DO NOT CALL WITH DYNAMIC MEMORY ALLOCATED.
  * The only supported exception is the temporary parser string
@@ -1112,17 +2211,42 @@ static void json_throw_parse_error(lua_State *l, json_parse_t *json,
                                    const char *exp, json_token_t *token)
 {
     const char *found;
+    char pos[FPCONV_G_FMT_BUFSIZE];
 
-    strbuf_free(json->tmp);
+    json_decode_release_buffer(json);
 
     if (token->type == T_ERROR)
         found = token->value.string;
     else
         found = json_token_type_name[token->type];
 
-    /* Note: token->index is 0 based, display starting from 1 */
-    luaL_error(l, "Expected %s but found %s at character %d",
-               exp, found, token->index + 1);
+    /* Note: token->index is 0 based, display starting from 1.
+     * Positions may exceed an int, so they are formatted here. */
+    pos[json_integer_to_str(pos, token->index + 1)] = '\0';
+    luaL_error(l, "Expected %s but found %s at character %s",
+               exp, found, pos);
+}
+
+static inline void json_skip_whitespace(json_parse_t *json)
+{
+    if (json->ptr < json->end &&
+        json->cfg->ch2token[(unsigned char)*json->ptr] == T_WHITESPACE)
+        json->ptr = scan_skip_whitespace(json->ptr + 1, json->end);
+}
+
+/* Skip the remainder of a string. Returns a pointer after the closing
+ * quote, or NULL if the string is not terminated. */
+static const char *json_skip_string(const char *p, const char *end)
+{
+    while ((p = scan_string(p, end)) < end) {
+        if (*p == '"')
+            return p + 1;
+        if (end - p < 2)
+            break;
+        p += 2;     /* Skip the escape */
+    }
+
+    return NULL;
 }
 
 static inline void json_decode_ascend(json_parse_t *json)
@@ -1132,6 +2256,8 @@ static inline void json_decode_ascend(json_parse_t *json)
 
 static void json_decode_descend(lua_State *l, json_parse_t *json, int slots)
 {
+    char pos[FPCONV_G_FMT_BUFSIZE];
+
     json->current_depth++;
 
     if (json->current_depth <= json->cfg->decode_max_depth &&
@@ -1139,25 +2265,137 @@ static void json_decode_descend(lua_State *l, json_parse_t *json, int slots)
         return;
     }
 
-    strbuf_free(json->tmp);
-    luaL_error(l, "Found too many nested data structures (%d) at character %d",
-        json->current_depth, json->ptr - json->data);
+    json_decode_release_buffer(json);
+    pos[json_integer_to_str(pos, json->ptr - json->data)] = '\0';
+    luaL_error(l, "Found too many nested data structures (%d) at character %s",
+        json->current_depth, pos);
+}
+
+/* Skip the next value without decoding it or using the Lua stack.
+ * Brackets and strings are matched, and nesting is limited by
+ * decode_max_depth, but the contents of skipped values are otherwise
+ * not validated. Returns the offset of the value.
+ *
+ * The closing bracket expected at each level is kept in json->tmp,
+ * which is not otherwise used while skipping. */
+static size_t json_skip_value(lua_State *l, json_parse_t *json)
+{
+    const char *end = json->end;
+    const char *start, *p;
+    json_token_t token;
+    char close;
+    int depth = 0;
+
+    json_skip_whitespace(json);
+    start = p = json->ptr;
+
+    if (p < end && (*p == '{' || *p == '[')) {
+        strbuf_reset(json->tmp);
+        do {
+            p = scan_structural(p, end);
+            if (p == end)
+                break;
+            switch (*p++) {
+            case '"':
+                p = json_skip_string(p, end);
+                break;
+            case '{':
+            case '[':
+                json->ptr = p;
+                json_decode_descend(l, json, 0);
+                strbuf_append_char(json->tmp, p[-1] == '{' ? '}' : ']');
+                depth++;
+                break;
+            default:
+                close = strbuf_string(json->tmp, NULL)[--depth];
+                if (p[-1] != close) {
+                    json->ptr = p - 1;
+                    json_next_token(json, &token);
+                    json_throw_parse_error(l, json, close == '}' ?
+                                           "comma or object end" :
+                                           "comma or array end", &token);
+                }
+                strbuf_set_length(json->tmp, depth);
+                json_decode_ascend(json);
+            }
+        } while (p && depth);
+    } else if (p < end && *p == '"') {
+        p = json_skip_string(p + 1, end);
+    } else if (p < end && json->cfg->ch2token[(unsigned char)*p] == T_UNKNOWN) {
+        /* Numbers and literals */
+        while (p < end && !json_is_delimiter(json, *p))
+            p++;
+    } else {
+        json_next_token(json, &token);
+        json_throw_parse_error(l, json, "value", &token);
+    }
+
+    if (!p || depth) {
+        json->ptr = end;
+        if (p)
+            token.type = T_END;
+        else
+            json_set_token_error(&token, json, "unexpected end of string");
+        token.index = end - json->data;
+        if (*start == '{')
+            json_throw_parse_error(l, json, "comma or object end", &token);
+        if (*start == '[')
+            json_throw_parse_error(l, json, "comma or array end", &token);
+        json_throw_parse_error(l, json, "value", &token);
+    }
+
+    json->ptr = p;
+
+    return start - json->data;
+}
+
+/* Return the expected number of elements for a new table at the
+ * current depth. The hint is capped by the remaining input since every
+ * element requires at least 2 characters. */
+static int json_decode_size_hint(json_parse_t *json, const int *hint)
+{
+    int depth = json->current_depth;
+    size_t max;
+
+    if (!json->cfg->decode_presize_tables || depth > DECODE_SIZE_HINT_DEPTH)
+        return 0;
+
+    max = (json->end - json->ptr) / 2 + 1;
+    if ((size_t)hint[depth - 1] > max)
+        return (int)max;
+
+    return hint[depth - 1];
+}
+
+static void json_decode_record_size(json_parse_t *json, int *hint, int count)
+{
+    int depth = json->current_depth;
+
+    if (json->cfg->decode_presize_tables && depth <= DECODE_SIZE_HINT_DEPTH)
+        hint[depth - 1] = count;
 }
 
 static void json_parse_object_context(lua_State *l, json_parse_t *json)
 {
     json_token_t token;
+    int count = 0;
 
     /* 3 slots required:
      * .., table, key, value */
     json_decode_descend(l, json, 3);
 
-    lua_newtable(l);
+    lua_createtable(l, 0,
+        json_decode_size_hint(json, json->cfg->decode_object_hint));
+    if (json->object_mt) {
+        lua_pushvalue(l, json->object_mt);
+        lua_setmetatable(l, -2);
+    }
 
     json_next_token(json, &token);
 
     /* Handle empty objects */
     if (token.type == T_OBJ_END) {
+        json_decode_record_size(json, json->cfg->decode_object_hint, 0);
         json_decode_ascend(json);
         return;
     }
@@ -1179,10 +2417,13 @@ static void json_parse_object_context(lua_State *l, json_parse_t *json)
 
         /* Set key = value */
         lua_rawset(l, -3);
+        count++;
 
         json_next_token(json, &token);
 
         if (token.type == T_OBJ_END) {
+            json_decode_record_size(json, json->cfg->decode_object_hint,
+                                    count);
             json_decode_ascend(json);
             return;
         }
@@ -1204,12 +2445,18 @@ static void json_parse_array_context(lua_State *l, json_parse_t *json)
      * .., table, value */
     json_decode_descend(l, json, 2);
 
-    lua_newtable(l);
+    lua_createtable(l,
+        json_decode_size_hint(json, json->cfg->decode_array_hint), 0);
+    if (json->array_mt) {
+        lua_pushvalue(l, json->array_mt);
+        lua_setmetatable(l, -2);
+    }
 
     json_next_token(json, &token);
 
     /* Handle empty arrays */
     if (token.type == T_ARR_END) {
+        json_decode_record_size(json, json->cfg->decode_array_hint, 0);
         json_decode_ascend(json);
         return;
     }
@@ -1221,6 +2468,7 @@ static void json_parse_array_context(lua_State *l, json_parse_t *json)
         json_next_token(json, &token);
 
         if (token.type == T_ARR_END) {
+            json_decode_record_size(json, json->cfg->decode_array_hint, i);
             json_decode_ascend(json);
             return;
         }
@@ -1232,6 +2480,19 @@ static void json_parse_array_context(lua_State *l, json_parse_t *json)
     }
 }
 
+/* Push an integer token. Lua 5.3+ can represent it exactly when
+ * lua_Integer is at least 64 bits wide. */
+static void json_push_integer(lua_State *l, int64_t value)
+{
+#if LUA_VERSION_NUM >= 503
+    if ((lua_Integer)value == value) {
+        lua_pushinteger(l, (lua_Integer)value);
+        return;
+    }
+#endif
+    lua_pushnumber(l, (lua_Number)value);
+}
+
 /* Handle the "value" context */
 static void json_process_value(lua_State *l, json_parse_t *json,
                                json_token_t *token)
@@ -1243,6 +2504,9 @@ static void json_process_value(lua_State *l, json_parse_t *json,
     case T_NUMBER:
         lua_pushnumber(l, token->value.number);
         break;;
+    case T_INTEGER:
+        json_push_integer(l, token->value.integer);
+        break;;
     case T_BOOLEAN:
         lua_pushboolean(l, token->value.boolean);
         break;;
@@ -1262,31 +2526,61 @@ static void json_process_value(lua_State *l, json_parse_t *json,
     }
 }
 
-static int json_decode(lua_State *l)
+/* Prepare to parse the JSON text between offsets [start, end) of data.
+ * Error positions are reported relative to data. */
+static void json_decode_begin(lua_State *l, json_parse_t *json,
+                              json_config_t *cfg, const char *data,
+                              size_t start, size_t end)
 {
-    json_parse_t json;
-    json_token_t token;
-    size_t json_len;
-
-    luaL_argcheck(l, lua_gettop(l) == 1, 1, "expected 1 argument");
-
-    json.cfg = json_fetch_config(l);
-    json.data = luaL_checklstring(l, 1, &json_len);
-    json.current_depth = 0;
-    json.ptr = json.data;
+    json->cfg = cfg;
+    json_call_init(&json->call, l, cfg);
+    json->data = data;
+    json->current_depth = 0;
+    json->ptr = data + start;
+    json->end = data + end;
+    json->array_mt = 0;
+    json->object_mt = 0;
 
     /* Detect Unicode other than UTF-8 (see RFC 4627, Sec 3)
      *
      * CJSON can support any simple data type, hence only the first
      * character is guaranteed to be ASCII (at worst: '"'). This is
      * still enough to detect whether the wrong encoding is in use. */
-    if (json_len >= 2 && (!json.data[0] || !json.data[1]))
+    if (end - start >= 2 && (!json->ptr[0] || !json->ptr[1]))
         luaL_error(l, "JSON parser does not support UTF-16 or UTF-32");
 
-    /* Ensure the temporary buffer can hold the entire string.
-     * This means we no longer need to do length checks since the decoded
-     * string must be smaller than the entire json string */
-    json.tmp = strbuf_new(json_len);
+    json->tmp = json_decode_acquire_buffer(json);
+
+    /* Keep the type markers on the stack for quick access */
+    if (json->cfg->decode_type_markers) {
+        json_push_marker(l, &json_array_mt_key);
+        json->array_mt = lua_gettop(l);
+        json_push_marker(l, &json_object_mt_key);
+        json->object_mt = lua_gettop(l);
+    }
+}
+
+/* Release parser resources, leaving the result on top of the stack */
+static void json_decode_end(lua_State *l, json_parse_t *json)
+{
+    json_decode_release_buffer(json);
+
+    /* Remove the type markers */
+    if (json->array_mt) {
+        lua_replace(l, json->array_mt);
+        lua_settop(l, json->array_mt);
+    }
+}
+
+/* Decode the JSON text between offsets [start, end) of data and push
+ * the resulting value */
+static void json_decode_text(lua_State *l, json_config_t *cfg,
+                             const char *data, size_t start, size_t end)
+{
+    json_parse_t json;
+    json_token_t token;
+
+    json_decode_begin(l, &json, cfg, data, start, end);
 
     json_next_token(&json, &token);
     json_process_value(l, &json, &token);
@@ -1297,88 +2591,1287 @@ static int json_decode(lua_State *l)
     if (token.type != T_END)
         json_throw_parse_error(l, &json, "the end", &token);
 
-    strbuf_free(json.tmp);
+    json_decode_end(l, &json);
+}
+
+typedef struct {
+    json_config_t *cfg;
+    const char *data;
+    size_t len;
+} json_decode_args_t;
+
+/* Decode the JSON text described by a json_decode_args_t lightuserdata.
+ * Used to run json_decode_text() under lua_pcall(). */
+static int json_decode_protected(lua_State *l)
+{
+    json_decode_args_t *args = (json_decode_args_t *)lua_touserdata(l, 1);
+
+    json_decode_text(l, args->cfg, args->data, 0, args->len);
 
     return 1;
 }
 
-/* ===== INITIALISATION ===== */
+/* Decode a JSON string, or the range [start, end] within it. Positions
+ * follow string.sub(), negative values count back from the end. */
+static int json_decode(lua_State *l)
+{
+    json_config_t *cfg;
+    const char *data;
+    size_t json_len;
+    lua_Integer start, end;
+
+    luaL_argcheck(l, lua_gettop(l) <= 3, 4, "found too many arguments");
+
+    cfg = json_fetch_config(l);
+    data = luaL_checklstring(l, 1, &json_len);
+    start = luaL_optinteger(l, 2, 1);
+    end = luaL_optinteger(l, 3, -1);
+
+    if (start < 0)
+        start += (lua_Integer)json_len + 1;
+    if (end < 0)
+        end += (lua_Integer)json_len + 1;
+    if (start < 1)
+        start = 1;
+    if (end > (lua_Integer)json_len)
+        end = json_len;
+    else if (end < 0)
+        end = 0;
+    if (start > end)
+        start = end + 1;
+
+    json_decode_text(l, cfg, data, start - 1, end);
 
-#if !defined(LUA_VERSION_NUM) || LUA_VERSION_NUM < 502
-/* Compatibility for Lua 5.1.
- *
- * luaL_setfuncs() is used to create a module table where the functions have
- * json_config_t as their first upvalue. Code borrowed from Lua 5.2 source. */
-static void luaL_setfuncs (lua_State *l, const luaL_Reg *reg, int nup)
+    return 1;
+}
+
+/* Decode consecutive JSON values separated by optional whitespace (eg,
+ * newline delimited JSON). Returns an array of up to "max" values, and
+ * the position of the next value when input remains. */
+static int json_decode_many(lua_State *l)
 {
-    int i;
+    json_config_t *cfg;
+    json_parse_t json;
+    json_token_t token;
+    const char *data;
+    size_t json_len;
+    lua_Integer max;
+    int count;
 
-    luaL_checkstack(l, nup, "too many upvalues");
-    for (; reg->name != NULL; reg++) {  /* fill the table with given functions */
-        for (i = 0; i < nup; i++)  /* copy upvalues to the top */
-            lua_pushvalue(l, -nup);
-        lua_pushcclosure(l, reg->func, nup);  /* closure with those upvalues */
-        lua_setfield(l, -(nup + 2), reg->name);
+    luaL_argcheck(l, lua_gettop(l) <= 2, 3, "found too many arguments");
+
+    cfg = json_fetch_config(l);
+    data = luaL_checklstring(l, 1, &json_len);
+    max = luaL_optinteger(l, 2, INT_MAX);
+    luaL_argcheck(l, max > 0, 2, "expected positive integer");
+    lua_settop(l, 1);
+
+    json_decode_begin(l, &json, cfg, data, 0, json_len);
+    lua_newtable(l);
+
+    count = 0;
+    json_next_token(&json, &token);
+    while (token.type != T_END && count < max) {
+        json_process_value(l, &json, &token);
+        lua_rawseti(l, -2, ++count);
+        json_next_token(&json, &token);
     }
-    lua_pop(l, nup);  /* remove upvalues */
+
+    json_decode_end(l, &json);
+
+    if (token.type == T_END)
+        return 1;
+
+    /* Note: token.index is 0 based, positions start from 1 */
+    lua_pushinteger(l, token.index + 1);
+
+    return 2;
 }
-#endif
 
-/* Call target function in protected mode with all supplied args.
- * Assumes target function only returns a single non-nil value.
- * Convert and return thrown errors as: nil, "error message" */
-static int json_protect_conversion(lua_State *l)
+/* A read-only copy of a file's contents. Files are mapped into memory
+ * when possible, otherwise "fp" is read into "buf". */
+typedef struct {
+    const char *data;
+    size_t size;
+    void *map;
+    size_t map_len;
+    FILE *fp;
+    strbuf_t buf;
+} json_file_t;
+
+/* Read the remainder of file->fp into file->buf. The buffer is released
+ * by json_file_close(), even when an allocation fails. */
+static const char *json_file_read(json_file_t *file, json_call_t *call)
 {
-    int err;
+    size_t len;
 
-    /* Deliberately throw an error for invalid arguments */
-    luaL_argcheck(l, lua_gettop(l) == 1, 1, "expected 1 argument");
+    strbuf_init_alloc(&file->buf, 0, &call->alloc);
+    do {
+        strbuf_ensure_empty_length(&file->buf, BUFSIZ);
+        len = fread(strbuf_empty_ptr(&file->buf), 1, BUFSIZ, file->fp);
+        strbuf_extend_length(&file->buf, len);
+    } while (len == BUFSIZ);
+    file->buf.alloc = &call->cfg->alloc;
 
-    /* pcall() the function stored as upvalue(1) */
-    lua_pushvalue(l, lua_upvalueindex(1));
-    lua_insert(l, 1);
-    err = lua_pcall(l, 1, 1, 0);
-    if (!err)
-        return 1;
+    if (ferror(file->fp))
+        return strerror(errno);
 
-    if (err == LUA_ERRRUN) {
-        lua_pushnil(l);
-        lua_insert(l, -2);
-        return 2;
-    }
+    file->data = strbuf_string(&file->buf, NULL);
+    file->size = strbuf_length(&file->buf);
 
-    /* Since we are not using a custom error handler, the only remaining
-     * errors are memory related */
-    return luaL_error(l, "Memory allocation error in CJSON protected call");
+    return NULL;
 }
 
-/* Return cjson module table */
-static int lua_cjson_new(lua_State *l)
+#ifndef _WIN32
+/* Map a regular file */
+static const char *json_file_map(json_file_t *file, int fd, size_t size)
 {
-    luaL_Reg reg[] = {
+    char *map;
+
+    map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED)
+        return strerror(errno);
+    file->map_len = size;
+
+#ifdef MADV_SEQUENTIAL
+    madvise(map, size, MADV_SEQUENTIAL);
+#endif
+
+    file->map = map;
+    file->data = map;
+    file->size = size;
+
+    return NULL;
+}
+#endif
+
+/* Open a file. Returns NULL on success, or an error message. Streams
+ * are left open for json_file_read(). */
+static const char *json_file_open(json_file_t *file, const char *path)
+{
+    const char *err;
+    FILE *fp;
+
+    memset(file, 0, sizeof(*file));
+
+#ifndef _WIN32
+    {
+        struct stat st;
+        int fd;
+
+        fd = open(path, O_RDONLY);
+        if (fd < 0)
+            return strerror(errno);
+        if (fstat(fd, &st) < 0) {
+            err = strerror(errno);
+            close(fd);
+            return err;
+        }
+
+        /* Empty files cannot be mapped, and pipes or devices must be
+         * read as a stream */
+        if (S_ISREG(st.st_mode) && st.st_size > 0) {
+            err = json_file_map(file, fd, st.st_size);
+            close(fd);
+            return err;
+        }
+
+        fp = fdopen(fd, "rb");
+        if (!fp) {
+            err = strerror(errno);
+            close(fd);
+            return err;
+        }
+    }
+#else
+    fp = fopen(path, "rb");
+    if (!fp)
+        return strerror(errno);
+#endif
+
+    file->fp = fp;
+
+    return NULL;
+}
+
+static void json_file_close(json_file_t *file)
+{
+#ifndef _WIN32
+    if (file->map)
+        munmap(file->map, file->map_len);
+#endif
+    if (file->fp)
+        fclose(file->fp);
+    strbuf_free(&file->buf);
+}
+
+/* Read (when required) and decode a json_file_t lightuserdata. Run
+ * under lua_pcall() so the file is always closed.
+ * Stack: file, config, path */
+static int json_decode_file_protected(lua_State *l)
+{
+    json_file_t *file = (json_file_t *)lua_touserdata(l, 1);
+    json_config_t *cfg = (json_config_t *)lua_touserdata(l, 2);
+    json_call_t call;
+    const char *err;
+
+    if (file->fp) {
+        json_call_init(&call, l, cfg);
+        err = json_file_read(file, &call);
+        if (err)
+            luaL_error(l, "Cannot open %s: %s", lua_tostring(l, 3), err);
+    }
+
+    json_decode_text(l, cfg, file->data, 0, file->size);
+
+    return 1;
+}
+
+/* Decode a JSON file in place, without copying it into a Lua string */
+static int json_decode_file(lua_State *l)
+{
+    json_config_t *cfg;
+    json_file_t file;
+    const char *path;
+    const char *err;
+    int status;
+
+    luaL_argcheck(l, lua_gettop(l) == 1, 1, "expected 1 argument");
+
+    cfg = json_fetch_config(l);
+    path = luaL_checkstring(l, 1);
+
+    err = json_file_open(&file, path);
+    if (err)
+        return luaL_error(l, "Cannot open %s: %s", path, err);
+
+    lua_pushcfunction(l, json_decode_file_protected);
+    lua_pushlightuserdata(l, &file);
+    lua_pushlightuserdata(l, cfg);
+    lua_pushvalue(l, 1);
+    status = lua_pcall(l, 3, 1, 0);
+
+    json_file_close(&file);
+
+    if (status)
+        return lua_error(l);
+
+    return 1;
+}
+
+/* A JSON Pointer (RFC 6901) split into reference tokens */
+typedef struct {
+    const char *str;
+    size_t len;
+    int index;          /* Array index, or -1 */
+} json_segment_t;
+
+typedef struct {
+    json_segment_t *segment;
+    int length;
+} json_pointer_t;
+
+typedef struct {
+    json_pointer_t *pointer;
+    char *settled;      /* Pointer has been found, or cannot exist */
+    int remaining;      /* Pointers which have not been settled */
+    int results;        /* Stack index of the results table */
+} json_path_t;
+
+/* Returns the array index referenced by a token, or -1 */
+static int json_pointer_index(const char *str, size_t len)
+{
+    int index = 0;
+    size_t i;
+
+    if (!len || len > 9 || (str[0] == '0' && len > 1))
+        return -1;
+
+    for (i = 0; i < len; i++) {
+        if (str[i] < '0' || '9' < str[i])
+            return -1;
+        index = index * 10 + (str[i] - '0');
+    }
+
+    return index;
+}
+
+/* Split the JSON Pointer at stack index "arg". Unescaped tokens and the
+ * token array are referenced from the table at stack index "anchor". */
+static void json_parse_pointer(lua_State *l, int arg,
+                               json_pointer_t *pointer, int anchor)
+{
+    json_segment_t *segment;
+    const char *str, *end, *p;
+    size_t len;
+    int i, n;
+
+    str = lua_tolstring(l, arg, &len);
+    end = str + len;
+    if (len && *str != '/')
+        luaL_argerror(l, arg, "invalid JSON pointer");
+
+    for (n = 0, p = str; p < end; p++)
+        n += *p == '/';
+
+    segment = (json_segment_t *)lua_newuserdata(l, n * sizeof(*segment));
+    lua_rawseti(l, anchor, lua_rawlen(l, anchor) + 1);
+
+    for (i = 0, p = str + 1; i < n; i++, p++) {
+        segment[i].str = p;
+        p = memchr(p, '/', end - p);
+        if (!p)
+            p = end;
+        segment[i].len = p - segment[i].str;
+
+        /* Unescape "~1" and "~0" */
+        if (memchr(segment[i].str, '~', segment[i].len)) {
+            lua_pushlstring(l, segment[i].str, segment[i].len);
+            luaL_gsub(l, lua_tostring(l, -1), "~1", "/");
+            luaL_gsub(l, lua_tostring(l, -1), "~0", "~");
+            segment[i].str = lua_tolstring(l, -1, &segment[i].len);
+            lua_rawseti(l, anchor, lua_rawlen(l, anchor) + 1);
+            lua_pop(l, 2);
+        }
+        segment[i].index = json_pointer_index(segment[i].str, segment[i].len);
+    }
+
+    pointer->segment = segment;
+    pointer->length = n;
+}
+
+/* Find the values of the "active" pointers within the next value. Only
+ * the members on a pointer's path are visited, other values are skipped
+ * with json_skip_value(). Values which are found are stored in the
+ * results table.
+ *
+ * The first member matching a reference token is used. Once it has
+ * been visited the pointer is settled, so the walk can stop as soon as
+ * every pointer is settled. */
+static void json_path_walk(lua_State *l, json_parse_t *json,
+                           json_path_t *path, const int *active,
+                           int count, int depth)
+{
+    json_token_t token;
+    json_token_type_t close;
+    json_segment_t *segment;
+    const char *start;
+    const char *key = NULL;
+    size_t key_len = 0;
+    int local[8];
+    int *next = local;
+    int deeper = 0;
+    int i, n, index;
+
+    for (i = 0; i < count; i++) {
+        if (path->pointer[active[i]].length > depth)
+            deeper++;
+    }
+
+    json_skip_whitespace(json);
+    start = json->ptr;
+
+    if (deeper && start < json->end && (*start == '{' || *start == '[')) {
+        close = *start == '{' ? T_OBJ_END : T_ARR_END;
+
+        /* 1 slot required for large pointer lists */
+        json_decode_descend(l, json, 1);
+        if (deeper > 8)
+            next = (int *)lua_newuserdata(l, deeper * sizeof(*next));
+
+        json->ptr++;
+        json_skip_whitespace(json);
+        if (json->ptr < json->end &&
+            json->cfg->ch2token[(unsigned char)*json->ptr] == close) {
+            json->ptr++;
+        } else {
+            for (index = 0; ; index++) {
+                if (close == T_OBJ_END) {
+                    json_next_token(json, &token);
+                    if (token.type != T_STRING)
+                        json_throw_parse_error(l, json, "object key string", &token);
+                    key = token.value.string;
+                    key_len = token.string_len;
+                }
+
+                /* Select the pointers which continue into this member */
+                for (i = 0, n = 0; i < count; i++) {
+                    if (path->settled[active[i]] ||
+                        path->pointer[active[i]].length <= depth)
+                        continue;
+                    segment = &path->pointer[active[i]].segment[depth];
+                    if (close == T_OBJ_END ?
+                        segment->len == key_len &&
+                        !memcmp(segment->str, key, key_len) :
+                        segment->index == index) {
+                        next[n++] = active[i];
+                    }
+                }
+
+                if (close == T_OBJ_END) {
+                    json_next_token(json, &token);
+                    if (token.type != T_COLON)
+                        json_throw_parse_error(l, json, "colon", &token);
+                }
+
+                if (n) {
+                    json_path_walk(l, json, path, next, n, depth + 1);
+
+                    /* Pointers not found within the member do not exist */
+                    for (i = 0; i < n; i++) {
+                        if (!path->settled[next[i]]) {
+                            path->settled[next[i]] = 1;
+                            path->remaining--;
+                        }
+                    }
+                    if (!path->remaining)
+                        break;
+                } else {
+                    json_skip_value(l, json);
+                }
+
+                json_next_token(json, &token);
+                if (token.type == close)
+                    break;
+                if (token.type != T_COMMA) {
+                    json_throw_parse_error(l, json, close == T_OBJ_END ?
+                                           "comma or object end" :
+                                           "comma or array end", &token);
+                }
+            }
+        }
+
+        if (next != local)
+            lua_pop(l, 1);
+        json_decode_ascend(json);
+    } else if (deeper) {
+        /* Pointers cannot continue into a scalar value */
+        json_skip_value(l, json);
+    }
+
+    if (deeper == count)
+        return;
+
+    /* Decode the value for pointers which end here */
+    json->ptr = start;
+    json_next_token(json, &token);
+    json_process_value(l, json, &token);
+    for (i = 0; i < count; i++) {
+        if (path->pointer[active[i]].length == depth) {
+            lua_pushvalue(l, -1);
+            lua_rawseti(l, path->results, active[i] + 1);
+            path->settled[active[i]] = 1;
+            path->remaining--;
+        }
+    }
+    lua_pop(l, 1);
+}
+
+/* Push a table with the value found for each pointer */
+static void json_decode_pointers(lua_State *l, json_config_t *cfg,
+                                 const char *data, size_t json_len,
+                                 json_pointer_t *pointer, int count)
+{
+    json_parse_t json;
+    json_path_t path;
+    int *active;
+    int i;
+
+    json_decode_begin(l, &json, cfg, data, 0, json_len);
+    lua_createtable(l, count, 0);
+
+    path.pointer = pointer;
+    path.remaining = count;
+    path.results = lua_gettop(l);
+
+    active = (int *)lua_newuserdata(l, count * (sizeof(*active) + 1));
+    path.settled = (char *)(active + count);
+    for (i = 0; i < count; i++) {
+        active[i] = i;
+        path.settled[i] = 0;
+    }
+
+    if (count)
+        json_path_walk(l, &json, &path, active, count, 0);
+    lua_pop(l, 1);
+
+    json_decode_end(l, &json);
+}
+
+/* cjson.decode_path(json_text, pointer) - Decode the value referenced
+ * by a JSON Pointer, or return nil if it does not exist. */
+static int json_decode_path(lua_State *l)
+{
+    json_config_t *cfg;
+    json_pointer_t pointer;
+    const char *data;
+    size_t json_len;
+
+    luaL_argcheck(l, lua_gettop(l) == 2, 1, "expected 2 arguments");
+
+    cfg = json_fetch_config(l);
+    data = luaL_checklstring(l, 1, &json_len);
+    luaL_checktype(l, 2, LUA_TSTRING);
+
+    lua_newtable(l);
+    json_parse_pointer(l, 2, &pointer, 3);
+    json_decode_pointers(l, cfg, data, json_len, &pointer, 1);
+    lua_rawgeti(l, -1, 1);
+
+    return 1;
+}
+
+/* cjson.decode_paths(json_text, pointers) - Decode the values referenced
+ * by an array of JSON Pointers in a single pass. */
+static int json_decode_paths(lua_State *l)
+{
+    json_config_t *cfg;
+    json_pointer_t *pointer;
+    const char *data;
+    size_t json_len;
+    int count, i;
+
+    luaL_argcheck(l, lua_gettop(l) == 2, 1, "expected 2 arguments");
+
+    cfg = json_fetch_config(l);
+    data = luaL_checklstring(l, 1, &json_len);
+    luaL_checktype(l, 2, LUA_TTABLE);
+    count = lua_rawlen(l, 2);
+
+    /* Stack: json_text, pointers, anchor, pointer array */
+    lua_newtable(l);
+    pointer = (json_pointer_t *)lua_newuserdata(l, count * sizeof(*pointer));
+    for (i = 0; i < count; i++) {
+        lua_rawgeti(l, 2, i + 1);
+        if (lua_type(l, -1) != LUA_TSTRING)
+            luaL_argerror(l, 2, "expected array of JSON pointers");
+        json_parse_pointer(l, 5, &pointer[i], 3);
+        lua_pop(l, 1);
+    }
+
+    json_decode_pointers(l, cfg, data, json_len, pointer, count);
+
+    return 1;
+}
+
+/* ===== INCREMENTAL DECODING ===== */
+
+/* cjson.decoder() objects accumulate input until a complete top level
+ * value is available, which is then decoded with json_decode_text().
+ *
+ * The structure of the input is tracked as each chunk arrives (string,
+ * escape and nesting state), so each byte is only scanned once to find
+ * the end of a value. */
+typedef struct {
+    strbuf_t buf;
+    ptrdiff_t consumed; /* Bytes of values already returned */
+    ptrdiff_t pos;      /* Next byte to scan */
+    ptrdiff_t start;    /* Start of the current value, -1 if not found */
+    int depth;          /* Nesting depth of arrays and objects */
+    int in_string;
+    int escape;         /* Previous string character was a backslash */
+    int scalar;         /* Current value is a number or literal */
+} json_decoder_t;
+
+static void json_decoder_reset(json_decoder_t *dec)
+{
+    dec->pos = dec->consumed;
+    dec->start = -1;
+    dec->depth = 0;
+    dec->in_string = 0;
+    dec->escape = 0;
+    dec->scalar = 0;
+}
+
+static inline int json_is_scalar_end(char ch)
+{
+    return ch == ' ' || ch == '\t' || ch == '\n' || ch == '\r' ||
+           ch == '[' || ch == ']' || ch == '{' || ch == '}' ||
+           ch == ',' || ch == ':' || ch == '"';
+}
+
+/* Scan newly buffered input. Returns the offset after the end of the
+ * current value, or -1 when more input is required. */
+static ptrdiff_t json_decoder_scan(json_decoder_t *dec)
+{
+    const char *buf = dec->buf.buf;
+    ptrdiff_t len = strbuf_length(&dec->buf);
+    ptrdiff_t i = dec->pos;
+    char ch;
+
+    if (dec->start < 0) {
+        i = scan_skip_whitespace(buf + i, buf + len) - buf;
+        if (i >= len) {
+            /* Discard whitespace between values */
+            strbuf_reset(&dec->buf);
+            dec->consumed = 0;
+            dec->pos = 0;
+            return -1;
+        }
+
+        dec->start = i;
+        ch = buf[i++];
+        if (ch == '{' || ch == '[') {
+            dec->depth = 1;
+        } else if (ch == '"') {
+            dec->in_string = 1;
+        } else if (ch == '}' || ch == ']' || ch == ',' || ch == ':') {
+            /* Invalid, json_decode_text() will report the error */
+            return i;
+        } else {
+            dec->scalar = 1;
+        }
+    }
+
+    if (dec->scalar) {
+        while (i < len && !json_is_scalar_end(buf[i]))
+            i++;
+        dec->pos = i;
+        return i < len ? i : -1;
+    }
+
+    while (i < len) {
+        if (dec->in_string) {
+            if (dec->escape) {
+                dec->escape = 0;
+                i++;
+                continue;
+            }
+            i = scan_string(buf + i, buf + len) - buf;
+            if (i >= len)
+                break;
+            ch = buf[i++];
+            if (ch == '\\')
+                dec->escape = 1;
+            else if (ch == '"') {
+                dec->in_string = 0;
+                if (!dec->depth)
+                    return i;
+            }
+            continue;
+        }
+
+        ch = buf[i++];
+        if (ch == '"') {
+            dec->in_string = 1;
+        } else if (ch == '{' || ch == '[') {
+            dec->depth++;
+        } else if (ch == '}' || ch == ']') {
+            if (--dec->depth == 0)
+                return i;
+        }
+    }
+
+    dec->pos = i;
+    return -1;
+}
+
+/* Remove values which have already been returned from the buffer.
+ * This only happens once they make up half of the buffered input, so
+ * returning many buffered values does not move the remainder each
+ * time. */
+static void json_decoder_compact(json_decoder_t *dec)
+{
+    ptrdiff_t len = strbuf_length(&dec->buf);
+    ptrdiff_t n = dec->consumed;
+
+    if (n == 0 || n < len - n)
+        return;
+
+    memmove(dec->buf.buf, dec->buf.buf + n, len - n);
+    strbuf_set_length(&dec->buf, len - n);
+    dec->consumed = 0;
+    dec->pos -= n;
+    if (dec->start >= 0)
+        dec->start -= n;
+}
+
+/* Decode the value ending at "end", then mark it as consumed */
+static void json_decoder_emit(lua_State *l, json_config_t *cfg,
+                              json_decoder_t *dec, ptrdiff_t end)
+{
+    json_decode_args_t args;
+    int err;
+
+    args.cfg = cfg;
+    args.data = dec->buf.buf + dec->start;
+    args.len = end - dec->start;
+    lua_pushcfunction(l, json_decode_protected);
+    lua_pushlightuserdata(l, &args);
+    err = lua_pcall(l, 1, 1, 0);
+
+    dec->consumed = end;
+    json_decoder_reset(dec);
+
+    if (err)
+        lua_error(l);
+}
+
+static json_decoder_t *json_check_decoder(lua_State *l)
+{
+    json_decoder_t *dec = (json_decoder_t *)lua_touserdata(l, 1);
+
+    /* The decoder metatable is stored as upvalue(2) */
+    if (!dec || !lua_getmetatable(l, 1) ||
+        !lua_rawequal(l, -1, lua_upvalueindex(2)))
+        luaL_argerror(l, 1, "expected cjson decoder");
+    lua_pop(l, 1);
+
+    return dec;
+}
+
+/* decoder:feed([chunk]) - Append a chunk of JSON text. Returns the next
+ * complete value, or nil when more input is required. */
+static int json_decoder_feed(lua_State *l)
+{
+    json_config_t *cfg = json_fetch_config(l);
+    json_decoder_t *dec = json_check_decoder(l);
+    json_call_t call;
+    const char *chunk;
+    size_t len;
+    ptrdiff_t end;
+
+    chunk = luaL_optlstring(l, 2, "", &len);
+    json_decoder_compact(dec);
+    json_call_init(&call, l, cfg);
+    dec->buf.alloc = &call.alloc;
+    strbuf_append_mem(&dec->buf, chunk, len);
+    dec->buf.alloc = &cfg->alloc;
+
+    end = json_decoder_scan(dec);
+    if (end < 0)
+        return 0;
+
+    json_decoder_emit(l, cfg, dec, end);
+
+    return 1;
+}
+
+/* decoder:finish() - Signal the end of input. Returns the final value,
+ * or nil if only whitespace remains. Raises an error for incomplete
+ * input. */
+static int json_decoder_finish(lua_State *l)
+{
+    json_config_t *cfg = json_fetch_config(l);
+    json_decoder_t *dec = json_check_decoder(l);
+    json_call_t call;
+    ptrdiff_t end;
+
+    end = json_decoder_scan(dec);
+    if (end < 0) {
+        if (dec->start < 0)
+            return 0;
+        end = strbuf_length(&dec->buf);
+    }
+
+    json_call_init(&call, l, cfg);
+    dec->buf.alloc = &call.alloc;
+    strbuf_ensure_null(&dec->buf);
+    dec->buf.alloc = &cfg->alloc;
+    json_decoder_emit(l, cfg, dec, end);
+
+    return 1;
+}
+
+static int json_decoder_gc(lua_State *l)
+{
+    json_decoder_t *dec = (json_decoder_t *)lua_touserdata(l, 1);
+
+    strbuf_free(&dec->buf);
+
+    return 0;
+}
+
+/* cjson.decoder() - Create an incremental decoder. The decoder
+ * metatable is stored as upvalue(2). */
+static int json_decoder_new(lua_State *l)
+{
+    json_config_t *cfg = json_fetch_config(l);
+    json_decoder_t *dec;
+    json_call_t call;
+
+    dec = (json_decoder_t *)lua_newuserdata(l, sizeof(*dec));
+    json_call_init(&call, l, cfg);
+    strbuf_init_alloc(&dec->buf, 0, &call.alloc);
+    dec->buf.alloc = &cfg->alloc;
+    dec->consumed = 0;
+    json_decoder_reset(dec);
+
+    lua_pushvalue(l, lua_upvalueindex(2));
+    lua_setmetatable(l, -2);
+
+    return 1;
+}
+
+/* Create the decoder metatable and set cjson.decoder.
+ * Stack: module, config */
+static void json_create_decoder(lua_State *l)
+{
+    luaL_Reg methods[] = {
+        { "feed", json_decoder_feed },
+        { "finish", json_decoder_finish },
+        { NULL, NULL }
+    };
+    int i;
+
+    /* metatable = { __gc = ..., __index = { feed = ..., ... } } */
+    lua_newtable(l);
+    lua_pushcfunction(l, json_decoder_gc);
+    lua_setfield(l, -2, "__gc");
+
+    /* Methods have the config and metatable as upvalues */
+    lua_newtable(l);
+    for (i = 0; methods[i].name; i++) {
+        lua_pushvalue(l, -3);
+        lua_pushvalue(l, -3);
+        lua_pushcclosure(l, methods[i].func, 2);
+        lua_setfield(l, -2, methods[i].name);
+    }
+    lua_setfield(l, -2, "__index");
+
+    lua_pushvalue(l, -2);
+    lua_pushvalue(l, -2);
+    lua_pushcclosure(l, json_decoder_new, 2);
+    lua_setfield(l, -4, "decoder");
+    lua_pop(l, 1);
+}
+
+/* ===== LAZY DECODING ===== */
+
+/* cjson.view() objects decode the members of an object or array on
+ * demand. The first access builds an index of the offset of each
+ * member's value, skipping nested values with json_skip_value(). Scalar
+ * values are decoded when read, while nested objects and arrays are
+ * returned as views of their own.
+ *
+ * The view's uservalue table holds the JSON text, the index and any
+ * values decoded so far. */
+typedef struct {
+    const char *data;   /* JSON text, referenced by the uservalue */
+    size_t start;       /* Offset of the opening bracket */
+    size_t end;         /* Length of the JSON text */
+    int root;           /* Reject trailing text after the value */
+    int count;          /* Number of members, -1 until indexed */
+} json_view_t;
+
+#define VIEW_TEXT   1
+#define VIEW_INDEX  2
+#define VIEW_VALUES 3
+
+static json_view_t *json_check_view(lua_State *l)
+{
+    json_view_t *view = (json_view_t *)lua_touserdata(l, 1);
+
+    /* The view metatable is stored as upvalue(2) */
+    if (!view || !lua_getmetatable(l, 1) ||
+        !lua_rawequal(l, -1, lua_upvalueindex(2)))
+        luaL_argerror(l, 1, "expected cjson view");
+    lua_pop(l, 1);
+
+    return view;
+}
+
+/* Push a view of the object or array at "start". The JSON text string
+ * must be at stack index "text". */
+static void json_view_new(lua_State *l, const char *data, size_t start,
+                          size_t end, int root, int text)
+{
+    json_view_t *view;
+
+    view = (json_view_t *)lua_newuserdata(l, sizeof(*view));
+    view->data = data;
+    view->start = start;
+    view->end = end;
+    view->root = root;
+    view->count = -1;
+
+    lua_createtable(l, 3, 0);
+    lua_pushvalue(l, text);
+    lua_rawseti(l, -2, VIEW_TEXT);
+    lua_setuservalue(l, -2);
+
+    lua_pushvalue(l, lua_upvalueindex(2));
+    lua_setmetatable(l, -2);
+}
+
+static void json_view_begin(lua_State *l, json_parse_t *json,
+                            json_config_t *cfg, json_view_t *view,
+                            size_t offset)
+{
+    json->cfg = cfg;
+    json_call_init(&json->call, l, cfg);
+    json->data = view->data;
+    json->ptr = view->data + offset;
+    json->end = view->data + view->end;
+    json->current_depth = 0;
+    json->array_mt = 0;
+    json->object_mt = 0;
+    json->tmp = json_decode_acquire_buffer(json);
+}
+
+/* Index the members of a view. Only the structure of this object or
+ * array is validated, nested values are checked when accessed. */
+static void json_view_index(lua_State *l, json_config_t *cfg,
+                            json_view_t *view, int uservalue)
+{
+    json_parse_t json;
+    json_token_t token;
+    json_token_type_t close;
+    int count = 0;
+
+    json_view_begin(l, &json, cfg, view, view->start);
+    close = *json.ptr == '{' ? T_OBJ_END : T_ARR_END;
+    json.ptr++;
+
+    lua_newtable(l);
+
+    json_skip_whitespace(&json);
+    if (json.ptr < json.end && cfg->ch2token[(unsigned char)*json.ptr] == close) {
+        json.ptr++;
+    } else {
+        while (1) {
+            if (close == T_OBJ_END) {
+                json_next_token(&json, &token);
+                if (token.type != T_STRING)
+                    json_throw_parse_error(l, &json, "object key string", &token);
+                lua_pushlstring(l, token.value.string, token.string_len);
+
+                json_next_token(&json, &token);
+                if (token.type != T_COLON)
+                    json_throw_parse_error(l, &json, "colon", &token);
+            } else {
+                lua_pushinteger(l, count + 1);
+            }
+
+            /* Set index[key] = offset */
+            lua_pushinteger(l, json_skip_value(l, &json));
+            lua_rawset(l, -3);
+            count++;
+
+            json_next_token(&json, &token);
+            if (token.type == close)
+                break;
+            if (token.type != T_COMMA) {
+                json_throw_parse_error(l, &json, close == T_OBJ_END ?
+                                       "comma or object end" :
+                                       "comma or array end", &token);
+            }
+        }
+    }
+
+    if (view->root) {
+        json_next_token(&json, &token);
+        if (token.type != T_END)
+            json_throw_parse_error(l, &json, "the end", &token);
+    }
+
+    json_decode_release_buffer(&json);
+
+    lua_rawseti(l, uservalue, VIEW_INDEX);
+    lua_newtable(l);
+    lua_rawseti(l, uservalue, VIEW_VALUES);
+    view->count = count;
+}
+
+/* Decode the value at "offset". Objects and arrays are pushed as views. */
+static void json_view_decode(lua_State *l, json_config_t *cfg,
+                             json_view_t *view, int uservalue, size_t offset)
+{
+    json_parse_t json;
+    json_token_t token;
+
+    if (view->data[offset] == '{' || view->data[offset] == '[') {
+        lua_rawgeti(l, uservalue, VIEW_TEXT);
+        json_view_new(l, view->data, offset, view->end, 0, lua_gettop(l));
+        lua_remove(l, -2);
+        return;
+    }
+
+    json_view_begin(l, &json, cfg, view, offset);
+    json_next_token(&json, &token);
+    json_process_value(l, &json, &token);
+
+    /* json_skip_value() accepted the value up to the next delimiter */
+    if (json.ptr < json.end && !json_is_delimiter(&json, *json.ptr)) {
+        json_next_token(&json, &token);
+        json_throw_parse_error(l, &json, view->data[view->start] == '{' ?
+                               "comma or object end" :
+                               "comma or array end", &token);
+    }
+
+    json_decode_release_buffer(&json);
+}
+
+/* Push the value of the key at stack index "key", or nil */
+static void json_view_get(lua_State *l, json_config_t *cfg,
+                          json_view_t *view, int uservalue, int key)
+{
+    size_t offset;
+
+    if (view->count < 0)
+        json_view_index(l, cfg, view, uservalue);
+
+    /* Return previously decoded values */
+    lua_rawgeti(l, uservalue, VIEW_VALUES);
+    lua_pushvalue(l, key);
+    lua_rawget(l, -2);
+    if (!lua_isnil(l, -1)) {
+        lua_remove(l, -2);
+        return;
+    }
+    lua_pop(l, 1);
+
+    lua_rawgeti(l, uservalue, VIEW_INDEX);
+    lua_pushvalue(l, key);
+    lua_rawget(l, -2);
+    if (lua_isnil(l, -1)) {
+        lua_replace(l, -3);
+        lua_pop(l, 1);
+        return;
+    }
+    offset = lua_tointeger(l, -1);
+    lua_pop(l, 2);
+
+    /* Stack: .., values table */
+    json_view_decode(l, cfg, view, uservalue, offset);
+    lua_pushvalue(l, key);
+    lua_pushvalue(l, -2);
+    lua_rawset(l, -4);
+    lua_remove(l, -2);
+}
+
+/* view[key] */
+static int json_view_index_event(lua_State *l)
+{
+    json_config_t *cfg = json_fetch_config(l);
+    json_view_t *view = json_check_view(l);
+
+    lua_settop(l, 2);
+    lua_getuservalue(l, 1);
+    json_view_get(l, cfg, view, 3, 2);
+
+    return 1;
+}
+
+/* #view */
+static int json_view_len_event(lua_State *l)
+{
+    json_config_t *cfg = json_fetch_config(l);
+    json_view_t *view = json_check_view(l);
+
+    if (view->count < 0) {
+        lua_settop(l, 1);
+        lua_getuservalue(l, 1);
+        json_view_index(l, cfg, view, 2);
+    }
+    lua_pushinteger(l, view->count);
+
+    return 1;
+}
+
+/* Iterator returned by pairs(view) */
+static int json_view_next(lua_State *l)
+{
+    json_config_t *cfg = json_fetch_config(l);
+    json_view_t *view = json_check_view(l);
+
+    lua_settop(l, 2);
+    lua_getuservalue(l, 1);
+    if (view->count < 0)
+        json_view_index(l, cfg, view, 3);
+
+    lua_rawgeti(l, 3, VIEW_INDEX);
+    lua_pushvalue(l, 2);
+    if (!lua_next(l, 4))
+        return 0;
+
+    /* Stack: view, key, uservalue, index, next key, offset */
+    lua_pop(l, 1);
+    json_view_get(l, cfg, view, 3, 5);
+
+    return 2;
+}
+
+/* pairs(view), or cjson.view_pairs(view) for Lua 5.1 */
+static int json_view_pairs(lua_State *l)
+{
+    json_check_view(l);
+
+    lua_pushvalue(l, lua_upvalueindex(1));
+    lua_pushvalue(l, lua_upvalueindex(2));
+    lua_pushcclosure(l, json_view_next, 2);
+    lua_pushvalue(l, 1);
+    lua_pushnil(l);
+
+    return 3;
+}
+
+/* cjson.view(json_text) - Return a view of a JSON object or array.
+ * Other values are decoded immediately. */
+static int json_view(lua_State *l)
+{
+    json_config_t *cfg = json_fetch_config(l);
+    const char *data, *p;
+    size_t len;
+
+    luaL_argcheck(l, lua_gettop(l) == 1, 1, "expected 1 argument");
+
+    data = luaL_checklstring(l, 1, &len);
+    p = scan_skip_whitespace(data, data + len);
+    if (p == data + len || (*p != '{' && *p != '[')) {
+        json_decode_text(l, cfg, data, 0, len);
+        return 1;
+    }
+
+    json_view_new(l, data, p - data, len, 1, 1);
+
+    return 1;
+}
+
+/* Create the view metatable and set cjson.view / cjson.view_pairs.
+ * Stack: module, config */
+static void json_create_view(lua_State *l)
+{
+    luaL_Reg events[] = {
+        { "__index", json_view_index_event },
+        { "__len", json_view_len_event },
+        { "__pairs", json_view_pairs },
+        { NULL, NULL }
+    };
+    int i;
+
+    /* Metamethods have the config and metatable as upvalues */
+    lua_newtable(l);
+    for (i = 0; events[i].name; i++) {
+        lua_pushvalue(l, -2);
+        lua_pushvalue(l, -2);
+        lua_pushcclosure(l, events[i].func, 2);
+        lua_setfield(l, -2, events[i].name);
+    }
+
+    lua_pushvalue(l, -2);
+    lua_pushvalue(l, -2);
+    lua_pushcclosure(l, json_view, 2);
+    lua_setfield(l, -4, "view");
+
+    lua_pushvalue(l, -2);
+    lua_pushvalue(l, -2);
+    lua_pushcclosure(l, json_view_pairs, 2);
+    lua_setfield(l, -4, "view_pairs");
+    lua_pop(l, 1);
+}
+
+/* ===== INITIALISATION ===== */
+
+#if !defined(LUA_VERSION_NUM) || LUA_VERSION_NUM < 502
+/* Compatibility for Lua 5.1.
+ *
+ * luaL_setfuncs() is used to create a module table where the functions have
+ * json_config_t as their first upvalue. Code borrowed from Lua 5.2 source. */
+static void luaL_setfuncs (lua_State *l, const luaL_Reg *reg, int nup)
+{
+    int i;
+
+    luaL_checkstack(l, nup, "too many upvalues");
+    for (; reg->name != NULL; reg++) {  /* fill the table with given functions */
+        for (i = 0; i < nup; i++)  /* copy upvalues to the top */
+            lua_pushvalue(l, -nup);
+        lua_pushcclosure(l, reg->func, nup);  /* closure with those upvalues */
+        lua_setfield(l, -(nup + 2), reg->name);
+    }
+    lua_pop(l, nup);  /* remove upvalues */
+}
+#endif
+
+/* Call target function in protected mode with all supplied args.
+ * Assumes target function only returns a single non-nil value.
+ * Convert and return thrown errors as: nil, "error message" */
+static int json_protect_conversion(lua_State *l)
+{
+    char errmsg[40];
+    int min, max, nargs, err;
+
+    /* Deliberately throw an error for invalid arguments. The accepted
+     * number of arguments is stored as upvalue(2) and upvalue(3). */
+    min = lua_tointeger(l, lua_upvalueindex(2));
+    max = lua_tointeger(l, lua_upvalueindex(3));
+    nargs = lua_gettop(l);
+    if (min == max) {
+        snprintf(errmsg, sizeof(errmsg), "expected %d argument%s",
+                 min, min == 1 ? "" : "s");
+    } else {
+        snprintf(errmsg, sizeof(errmsg), "expected %d to %d arguments",
+                 min, max);
+    }
+    luaL_argcheck(l, min <= nargs && nargs <= max, 1, errmsg);
+
+    /* pcall() the function stored as upvalue(1) */
+    lua_pushvalue(l, lua_upvalueindex(1));
+    lua_insert(l, 1);
+    err = lua_pcall(l, nargs, LUA_MULTRET, 0);
+    if (!err)
+        return lua_gettop(l);
+
+    if (err == LUA_ERRRUN) {
+        lua_pushnil(l);
+        lua_insert(l, -2);
+        return 2;
+    }
+
+    /* Since we are not using a custom error handler, the only remaining
+     * errors are memory related */
+    return luaL_error(l, "Memory allocation error in CJSON protected call");
+}
+
+/* Return cjson module table */
+static int lua_cjson_new(lua_State *l)
+{
+    luaL_Reg reg[] = {
         { "encode", json_encode },
+        { "encode_to", json_encode_to },
+        { "encode_lines", json_encode_lines },
         { "decode", json_decode },
+        { "decode_many", json_decode_many },
+        { "decode_file", json_decode_file },
+        { "decode_path", json_decode_path },
+        { "decode_paths", json_decode_paths },
         { "encode_sparse_array", json_cfg_encode_sparse_array },
         { "encode_max_depth", json_cfg_encode_max_depth },
         { "decode_max_depth", json_cfg_decode_max_depth },
         { "encode_number_precision", json_cfg_encode_number_precision },
         { "encode_keep_buffer", json_cfg_encode_keep_buffer },
+        { "encode_chunk_size", json_cfg_encode_chunk_size },
+        { "encode_segmented", json_cfg_encode_segmented },
         { "encode_invalid_numbers", json_cfg_encode_invalid_numbers },
         { "decode_invalid_numbers", json_cfg_decode_invalid_numbers },
+        { "decode_type_markers", json_cfg_decode_type_markers },
+        { "decode_presize_tables", json_cfg_decode_presize_tables },
+        { "decode_keep_buffer", json_cfg_decode_keep_buffer },
+        { "buffer_stats", json_buffer_stats },
         { "new", lua_cjson_new },
         { NULL, NULL }
     };
+    json_config_t *cfg;
 
     /* Initialise number conversions */
     fpconv_init();
 
+    /* Select vectorised scanning routines */
+    scan_init();
+
     /* cjson module table */
     lua_newtable(l);
 
     /* Register functions with config data as upvalue */
-    json_create_config(l);
+    cfg = json_create_config(l);
+    json_create_decoder(l);
+    json_create_view(l);
     luaL_setfuncs(l, reg, 1);
 
+    /* Set cjson.array_mt / cjson.object_mt */
+    cfg->array_mt = json_create_marker(l, &json_array_mt_key, "array_mt");
+    cfg->object_mt = json_create_marker(l, &json_object_mt_key, "object_mt");
+
     /* Set cjson.null */
     lua_pushlightuserdata(l, NULL);
     lua_setfield(l, -2, "null");
@@ -1395,7 +3888,22 @@ static int lua_cjson_new(lua_State *l)
 /* Return cjson.safe module table */
 static int lua_cjson_safe_new(lua_State *l)
 {
-    const char *func[] = { "decode", "encode", NULL };
+    const struct {
+        const char *name;
+        int min_args;
+        int max_args;
+    } func[] = {
+        { "decode", 1, 3 },
+        { "decode_file", 1, 1 },
+        { "decode_many", 1, 2 },
+        { "decode_path", 2, 2 },
+        { "decode_paths", 2, 2 },
+        { "encode", 1, 1 },
+        { "encode_lines", 1, 2 },
+        { "encode_to", 2, 2 },
+        { "view", 1, 1 },
+        { NULL, 0, 0 }
+    };
     int i;
 
     lua_cjson_new(l);
@@ -1404,10 +3912,12 @@ static int lua_cjson_safe_new(lua_State *l)
     lua_pushcfunction(l, lua_cjson_safe_new);
     lua_setfield(l, -2, "new");
 
-    for (i = 0; func[i]; i++) {
-        lua_getfield(l, -1, func[i]);
-        lua_pushcclosure(l, json_protect_conversion, 1);
-        lua_setfield(l, -2, func[i]);
+    for (i = 0; func[i].name; i++) {
+        lua_getfield(l, -1, func[i].name);
+        lua_pushinteger(l, func[i].min_args);
+        lua_pushinteger(l, func[i].max_args);
+        lua_pushcclosure(l, json_protect_conversion, 3);
+        lua_setfield(l, -2, func[i].name);
     }
 
     return 1;
@@ -0,0 +1,348 @@
+/* scan - Vectorised JSON scanning routines
+ *
+ * Copyright (c) 2026  Lua CJSON contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/* Pretty printed JSON can contain more whitespace than data. Skipping
+ * it a byte at a time through the ch2token[] table dominates decoding
+ * time for such documents. Similarly, most strings contain no escapes
+ * and can be located and copied in bulk. The encoder likewise copies
+ * runs of characters which do not require escaping.
+ *
+ * SSE2 is always available on x86-64, and is used when the compiler
+ * targets it. AVX2 support is detected at run time (GCC/Clang only).
+ * Other platforms, or builds with DISABLE_SIMD, use portable C. */
+
+#include <stddef.h>
+
+#include "scan.h"
+
+#if !defined(DISABLE_SIMD)
+# if defined(__SSE2__) || defined(_M_X64) || \
+     (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#  define SCAN_HAVE_SSE2
+#  include <emmintrin.h>
+# endif
+# if defined(SCAN_HAVE_SSE2) && defined(__GNUC__) && \
+     (defined(__x86_64__) || defined(__i386__)) && \
+     (__GNUC__ >= 5 || defined(__clang__))
+#  define SCAN_HAVE_AVX2
+#  include <immintrin.h>
+# endif
+# if defined(_MSC_VER) && defined(SCAN_HAVE_SSE2)
+#  include <intrin.h>
+# endif
+#endif
+
+static const char *skip_whitespace_c(const char *ptr, const char *end)
+{
+    while (ptr < end &&
+           (*ptr == ' ' || *ptr == '\n' || *ptr == '\r' || *ptr == '\t'))
+        ptr++;
+
+    return ptr;
+}
+
+static const char *string_c(const char *ptr, const char *end)
+{
+    while (ptr < end && *ptr != '"' && *ptr != '\\')
+        ptr++;
+
+    return ptr;
+}
+
+static const char *structural_c(const char *ptr, const char *end)
+{
+    char ch;
+
+    while (ptr < end) {
+        ch = *ptr | 0x20;
+        if (ch == '{' || ch == '}' || *ptr == '"')
+            break;
+        ptr++;
+    }
+
+    return ptr;
+}
+
+static const char *escape_c(const char *ptr, const char *end)
+{
+    unsigned char ch;
+
+    while (ptr < end) {
+        ch = *ptr;
+        if (ch < 0x20 || ch == '"' || ch == '\\' || ch == '/' || ch == 0x7f)
+            break;
+        ptr++;
+    }
+
+    return ptr;
+}
+
+#ifdef SCAN_HAVE_SSE2
+
+/* Index of the lowest set bit. mask must be non-zero. */
+static inline int lowest_bit(unsigned int mask)
+{
+#ifdef _MSC_VER
+    unsigned long index;
+
+    _BitScanForward(&index, mask);
+    return index;
+#else
+    return __builtin_ctz(mask);
+#endif
+}
+
+static const char *skip_whitespace_sse2(const char *ptr, const char *end)
+{
+    const __m128i space = _mm_set1_epi8(' ');
+    const __m128i newline = _mm_set1_epi8('\n');
+    const __m128i cr = _mm_set1_epi8('\r');
+    const __m128i tab = _mm_set1_epi8('\t');
+    __m128i v, ws;
+    unsigned int mask;
+
+    while (end - ptr >= 16) {
+        v = _mm_loadu_si128((const __m128i *)ptr);
+        ws = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, space),
+                                       _mm_cmpeq_epi8(v, newline)),
+                          _mm_or_si128(_mm_cmpeq_epi8(v, cr),
+                                       _mm_cmpeq_epi8(v, tab)));
+        mask = ~_mm_movemask_epi8(ws) & 0xFFFF;
+        if (mask)
+            return ptr + lowest_bit(mask);
+        ptr += 16;
+    }
+
+    return skip_whitespace_c(ptr, end);
+}
+
+static const char *string_sse2(const char *ptr, const char *end)
+{
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    __m128i v, special;
+    unsigned int mask;
+
+    while (end - ptr >= 16) {
+        v = _mm_loadu_si128((const __m128i *)ptr);
+        special = _mm_or_si128(_mm_cmpeq_epi8(v, quote),
+                               _mm_cmpeq_epi8(v, backslash));
+        mask = _mm_movemask_epi8(special);
+        if (mask)
+            return ptr + lowest_bit(mask);
+        ptr += 16;
+    }
+
+    return string_c(ptr, end);
+}
+
+/* Setting bit 0x20 maps '[' and ']' onto '{' and '}' */
+static const char *structural_sse2(const char *ptr, const char *end)
+{
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i open = _mm_set1_epi8('{');
+    const __m128i close = _mm_set1_epi8('}');
+    const __m128i lower = _mm_set1_epi8(0x20);
+    __m128i v, folded, special;
+    unsigned int mask;
+
+    while (end - ptr >= 16) {
+        v = _mm_loadu_si128((const __m128i *)ptr);
+        folded = _mm_or_si128(v, lower);
+        special = _mm_or_si128(_mm_cmpeq_epi8(v, quote),
+                               _mm_or_si128(_mm_cmpeq_epi8(folded, open),
+                                            _mm_cmpeq_epi8(folded, close)));
+        mask = _mm_movemask_epi8(special);
+        if (mask)
+            return ptr + lowest_bit(mask);
+        ptr += 16;
+    }
+
+    return structural_c(ptr, end);
+}
+
+/* Control characters are found with an unsigned comparison:
+ * min(v, 0x1f) == v */
+static const char *escape_sse2(const char *ptr, const char *end)
+{
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i slash = _mm_set1_epi8('/');
+    const __m128i del = _mm_set1_epi8(0x7f);
+    const __m128i control = _mm_set1_epi8(0x1f);
+    __m128i v, special;
+    unsigned int mask;
+
+    while (end - ptr >= 16) {
+        v = _mm_loadu_si128((const __m128i *)ptr);
+        special = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(v, quote),
+                         _mm_cmpeq_epi8(v, backslash)),
+            _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, slash),
+                                      _mm_cmpeq_epi8(v, del)),
+                         _mm_cmpeq_epi8(_mm_min_epu8(v, control), v)));
+        mask = _mm_movemask_epi8(special);
+        if (mask)
+            return ptr + lowest_bit(mask);
+        ptr += 16;
+    }
+
+    return escape_c(ptr, end);
+}
+
+#endif  /* SCAN_HAVE_SSE2 */
+
+#ifdef SCAN_HAVE_AVX2
+
+__attribute__((target("avx2")))
+static const char *skip_whitespace_avx2(const char *ptr, const char *end)
+{
+    const __m256i space = _mm256_set1_epi8(' ');
+    const __m256i newline = _mm256_set1_epi8('\n');
+    const __m256i cr = _mm256_set1_epi8('\r');
+    const __m256i tab = _mm256_set1_epi8('\t');
+    __m256i v, ws;
+    unsigned int mask;
+
+    while (end - ptr >= 32) {
+        v = _mm256_loadu_si256((const __m256i *)ptr);
+        ws = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, space),
+                                             _mm256_cmpeq_epi8(v, newline)),
+                             _mm256_or_si256(_mm256_cmpeq_epi8(v, cr),
+                                             _mm256_cmpeq_epi8(v, tab)));
+        mask = ~(unsigned int)_mm256_movemask_epi8(ws);
+        if (mask)
+            return ptr + lowest_bit(mask);
+        ptr += 32;
+    }
+
+    return skip_whitespace_sse2(ptr, end);
+}
+
+__attribute__((target("avx2")))
+static const char *string_avx2(const char *ptr, const char *end)
+{
+    const __m256i quote = _mm256_set1_epi8('"');
+    const __m256i backslash = _mm256_set1_epi8('\\');
+    __m256i v, special;
+    unsigned int mask;
+
+    while (end - ptr >= 32) {
+        v = _mm256_loadu_si256((const __m256i *)ptr);
+        special = _mm256_or_si256(_mm256_cmpeq_epi8(v, quote),
+                                  _mm256_cmpeq_epi8(v, backslash));
+        mask = _mm256_movemask_epi8(special);
+        if (mask)
+            return ptr + lowest_bit(mask);
+        ptr += 32;
+    }
+
+    return string_sse2(ptr, end);
+}
+
+__attribute__((target("avx2")))
+static const char *structural_avx2(const char *ptr, const char *end)
+{
+    const __m256i quote = _mm256_set1_epi8('"');
+    const __m256i open = _mm256_set1_epi8('{');
+    const __m256i close = _mm256_set1_epi8('}');
+    const __m256i lower = _mm256_set1_epi8(0x20);
+    __m256i v, folded, special;
+    unsigned int mask;
+
+    while (end - ptr >= 32) {
+        v = _mm256_loadu_si256((const __m256i *)ptr);
+        folded = _mm256_or_si256(v, lower);
+        special = _mm256_or_si256(_mm256_cmpeq_epi8(v, quote),
+                                  _mm256_or_si256(_mm256_cmpeq_epi8(folded, open),
+                                                  _mm256_cmpeq_epi8(folded, close)));
+        mask = _mm256_movemask_epi8(special);
+        if (mask)
+            return ptr + lowest_bit(mask);
+        ptr += 32;
+    }
+
+    return structural_sse2(ptr, end);
+}
+
+__attribute__((target("avx2")))
+static const char *escape_avx2(const char *ptr, const char *end)
+{
+    const __m256i quote = _mm256_set1_epi8('"');
+    const __m256i backslash = _mm256_set1_epi8('\\');
+    const __m256i slash = _mm256_set1_epi8('/');
+    const __m256i del = _mm256_set1_epi8(0x7f);
+    const __m256i control = _mm256_set1_epi8(0x1f);
+    __m256i v, special;
+    unsigned int mask;
+
+    while (end - ptr >= 32) {
+        v = _mm256_loadu_si256((const __m256i *)ptr);
+        special = _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, quote),
+                            _mm256_cmpeq_epi8(v, backslash)),
+            _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, slash),
+                                            _mm256_cmpeq_epi8(v, del)),
+                            _mm256_cmpeq_epi8(_mm256_min_epu8(v, control), v)));
+        mask = _mm256_movemask_epi8(special);
+        if (mask)
+            return ptr + lowest_bit(mask);
+        ptr += 32;
+    }
+
+    return escape_sse2(ptr, end);
+}
+
+#endif  /* SCAN_HAVE_AVX2 */
+
+#ifdef SCAN_HAVE_SSE2
+const char *(*scan_skip_whitespace)(const char *, const char *) = skip_whitespace_sse2;
+const char *(*scan_string)(const char *, const char *) = string_sse2;
+const char *(*scan_structural)(const char *, const char *) = structural_sse2;
+const char *(*scan_escape)(const char *, const char *) = escape_sse2;
+#else
+const char *(*scan_skip_whitespace)(const char *, const char *) = skip_whitespace_c;
+const char *(*scan_string)(const char *, const char *) = string_c;
+const char *(*scan_structural)(const char *, const char *) = structural_c;
+const char *(*scan_escape)(const char *, const char *) = escape_c;
+#endif
+
+/* Select the fastest routines supported by this CPU. The result is
+ * the same for every thread, so repeated calls are harmless. */
+void scan_init()
+{
+#ifdef SCAN_HAVE_AVX2
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        scan_skip_whitespace = skip_whitespace_avx2;
+        scan_string = string_avx2;
+        scan_structural = structural_avx2;
+        scan_escape = escape_avx2;
+        return;
+    }
+#endif
+}
+
+/* vi:ai et sw=4 ts=4:
+ */
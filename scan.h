@@ -0,0 +1,28 @@
+/* Lua CJSON vectorised scanning routines */
+
+/* Scanning routines examine the bytes in [ptr, end) and return a
+ * pointer to the first byte of interest, or end if none was found.
+ * They never read at or beyond end.
+ *
+ * The fastest implementation supported by the CPU is selected by
+ * scan_init(). */
+
+extern void scan_init();
+
+/* Returns the first byte which is not JSON whitespace ([ \t\n\r]) */
+extern const char *(*scan_skip_whitespace)(const char *ptr, const char *end);
+
+/* Returns the first byte which ends a run of plain string characters:
+ * double quote or backslash */
+extern const char *(*scan_string)(const char *ptr, const char *end);
+
+/* Returns the first double quote, bracket or brace. Used to skip
+ * values without tokenising them. */
+extern const char *(*scan_structural)(const char *ptr, const char *end);
+
+/* Returns the first byte which must be escaped when encoding a string:
+ * control characters, double quote, backslash, forward slash or DEL */
+extern const char *(*scan_escape)(const char *ptr, const char *end);
+
+/* vi:ai et sw=4 ts=4:
+ */
@@ -25,6 +25,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <string.h>
 
 #include "strbuf.h"
@@ -41,46 +42,91 @@ static void die(const char *fmt, ...)
     exit(-1);
 }
 
-void strbuf_init(strbuf_t *s, int len)
+/* Resize or free memory with the allocator, or malloc() when unset */
+static void *strbuf_realloc(strbuf_alloc_t *alloc, void *ptr, size_t osize,
+                            size_t nsize)
 {
-    int size;
+    if (alloc)
+        return alloc->alloc(alloc->ud, ptr, osize, nsize);
 
-    if (len <= 0)
+    if (nsize == 0) {
+        free(ptr);
+        return NULL;
+    }
+
+    return realloc(ptr, nsize);
+}
+
+static void strbuf_alloc_error(strbuf_alloc_t *alloc, strbuf_t *s)
+{
+    if (alloc && alloc->error)
+        alloc->error(alloc->ctx, s);
+
+    die("Out of memory");
+}
+
+static void strbuf_setup(strbuf_t *s, size_t len, strbuf_alloc_t *alloc,
+                         int dynamic)
+{
+    size_t size;
+
+    if (len == 0)
         size = STRBUF_DEFAULT_SIZE;
-    else
+    else if (len < SIZE_MAX)
         size = len + 1;         /* \0 terminator */
+    else
+        size = 0;               /* Overflow, fails below */
 
     s->buf = NULL;
-    s->size = size;
+    s->size = 0;
     s->length = 0;
     s->increment = STRBUF_DEFAULT_INCREMENT;
-    s->dynamic = 0;
+    s->dynamic = dynamic;
     s->reallocs = 0;
+    s->peak = 0;
     s->debug = 0;
+    s->alloc = alloc;
 
-    s->buf = (char *)malloc(size);
+    /* The strbuf is left empty and unallocated if this fails */
+    if (size)
+        s->buf = (char *)strbuf_realloc(alloc, NULL, 0, size);
     if (!s->buf)
-        die("Out of memory");
+        strbuf_alloc_error(alloc, s);
+    s->size = size;
+    s->peak = size;
 
     strbuf_ensure_null(s);
 }
 
-strbuf_t *strbuf_new(int len)
+void strbuf_init_alloc(strbuf_t *s, size_t len, strbuf_alloc_t *alloc)
+{
+    strbuf_setup(s, len, alloc, 0);
+}
+
+void strbuf_init(strbuf_t *s, size_t len)
+{
+    strbuf_init_alloc(s, len, NULL);
+}
+
+strbuf_t *strbuf_new_alloc(size_t len, strbuf_alloc_t *alloc)
 {
     strbuf_t *s;
 
-    s = (strbuf_t*)malloc(sizeof(strbuf_t));
+    s = (strbuf_t*)strbuf_realloc(alloc, NULL, 0, sizeof(strbuf_t));
     if (!s)
-        die("Out of memory");
-
-    strbuf_init(s, len);
+        strbuf_alloc_error(alloc, NULL);
 
     /* Dynamic strbuf allocation / deallocation */
-    s->dynamic = 1;
+    strbuf_setup(s, len, alloc, 1);
 
     return s;
 }
 
+strbuf_t *strbuf_new(size_t len)
+{
+    return strbuf_new_alloc(len, NULL);
+}
+
 void strbuf_set_increment(strbuf_t *s, int increment)
 {
     /* Increment > 0:  Linear buffer growth rate
@@ -94,8 +140,9 @@ void strbuf_set_increment(strbuf_t *s, int increment)
 static inline void debug_stats(strbuf_t *s)
 {
     if (s->debug) {
-        fprintf(stderr, "strbuf(%lx) reallocs: %d, length: %d, size: %d\n",
-                (long)s, s->reallocs, s->length, s->size);
+        fprintf(stderr, "strbuf(%lx) reallocs: %d, length: %lu, size: %lu, "
+                "peak: %lu\n", (long)s, s->reallocs, (unsigned long)s->length,
+                (unsigned long)s->size, (unsigned long)s->peak);
     }
 }
 
@@ -106,14 +153,17 @@ void strbuf_free(strbuf_t *s)
     debug_stats(s);
 
     if (s->buf) {
-        free(s->buf);
+        strbuf_realloc(s->alloc, s->buf, s->size, 0);
         s->buf = NULL;
+        s->size = 0;
     }
     if (s->dynamic)
-        free(s);
+        strbuf_realloc(s->alloc, s, sizeof(strbuf_t), 0);
 }
 
-char *strbuf_free_to_string(strbuf_t *s, int *len)
+/* The returned string must be released with free(), so this is only
+ * supported for strbufs using the default allocator */
+char *strbuf_free_to_string(strbuf_t *s, size_t *len)
 {
     char *buf;
 
@@ -131,28 +181,39 @@ char *strbuf_free_to_string(strbuf_t *s, int *len)
     return buf;
 }
 
-static int calculate_new_size(strbuf_t *s, int len)
+/* Returns 0 if the size cannot be represented */
+static size_t calculate_new_size(strbuf_t *s, size_t len)
 {
-    int reqsize, newsize;
+    size_t reqsize, newsize, factor, increment;
 
-    if (len <= 0)
+    if (len == 0)
         die("BUG: Invalid strbuf length requested");
 
     /* Ensure there is room for optional NULL termination */
+    if (len == SIZE_MAX)
+        return 0;
     reqsize = len + 1;
 
     /* If the user has requested to shrink the buffer, do it exactly */
     if (s->size > reqsize)
         return reqsize;
 
-    newsize = s->size;
     if (s->increment < 0) {
-        /* Exponential sizing */
-        while (newsize < reqsize)
-            newsize *= -s->increment;
+        /* Exponential sizing. Use the exact size when the next step
+         * would overflow. */
+        factor = -s->increment;
+        newsize = s->size ? s->size : STRBUF_DEFAULT_SIZE;
+        while (newsize < reqsize) {
+            if (newsize > SIZE_MAX / factor)
+                return reqsize;
+            newsize *= factor;
+        }
     } else {
         /* Linear sizing */
-        newsize = ((newsize + s->increment - 1) / s->increment) * s->increment;
+        increment = s->increment;
+        if (reqsize > SIZE_MAX - (increment - 1))
+            return reqsize;
+        newsize = ((reqsize + increment - 1) / increment) * increment;
     }
 
     return newsize;
@@ -161,45 +222,49 @@ static int calculate_new_size(strbuf_t *s, int len)
 
 /* Ensure strbuf can handle a string length bytes long (ignoring NULL
  * optional termination). */
-void strbuf_resize(strbuf_t *s, int len)
+void strbuf_resize(strbuf_t *s, size_t len)
 {
-    int newsize;
+    char *newbuf = NULL;
+    size_t newsize;
 
     newsize = calculate_new_size(s, len);
 
     if (s->debug > 1) {
-        fprintf(stderr, "strbuf(%lx) resize: %d => %d\n",
-                (long)s, s->size, newsize);
+        fprintf(stderr, "strbuf(%lx) resize: %lu => %lu\n",
+                (long)s, (unsigned long)s->size, (unsigned long)newsize);
     }
 
+    /* The existing buffer remains valid if this fails */
+    if (newsize)
+        newbuf = (char *)strbuf_realloc(s->alloc, s->buf, s->size, newsize);
+    if (!newbuf)
+        strbuf_alloc_error(s->alloc, s);
+
+    s->buf = newbuf;
     s->size = newsize;
-    s->buf = (char *)realloc(s->buf, s->size);
-    if (!s->buf)
-        die("Out of memory");
     s->reallocs++;
+    if (newsize > s->peak)
+        s->peak = newsize;
 }
 
-void strbuf_append_string(strbuf_t *s, const char *str)
+/* Ensure there is room to append len bytes. Lengths beyond SIZE_MAX
+ * are reported as an allocation failure. */
+void strbuf_grow(strbuf_t *s, size_t len)
 {
-    int space, i;
+    if (len > SIZE_MAX - s->length)
+        strbuf_alloc_error(s->alloc, s);
 
-    space = strbuf_empty_length(s);
-
-    for (i = 0; str[i]; i++) {
-        if (space < 1) {
-            strbuf_resize(s, s->length + 1);
-            space = strbuf_empty_length(s);
-        }
+    strbuf_resize(s, s->length + len);
+}
 
-        s->buf[s->length] = str[i];
-        s->length++;
-        space--;
-    }
+void strbuf_append_string(strbuf_t *s, const char *str)
+{
+    strbuf_append_mem(s, str, strlen(str));
 }
 
 /* strbuf_append_fmt() should only be used when an upper bound
  * is known for the output string. */
-void strbuf_append_fmt(strbuf_t *s, int len, const char *fmt, ...)
+void strbuf_append_fmt(strbuf_t *s, size_t len, const char *fmt, ...)
 {
     va_list arg;
     int fmt_len;
@@ -222,7 +287,7 @@ void strbuf_append_fmt_retry(strbuf_t *s, const char *fmt, ...)
 {
     va_list arg;
     int fmt_len;
-    int empty_len;
+    size_t empty_len;
     int t;
 
     /* If the first attempt to append fails, resize the buffer appropriately
@@ -237,7 +302,9 @@ void strbuf_append_fmt_retry(strbuf_t *s, const char *fmt, ...)
         fmt_len = vsnprintf(s->buf + s->length, empty_len + 1, fmt, arg);
         va_end(arg);
 
-        if (fmt_len <= empty_len)
+        if (fmt_len < 0)
+            die("BUG: Unable to format string");
+        if ((size_t)fmt_len <= empty_len)
             break;  /* SUCCESS */
         if (t > 0)
             die("BUG: length of formatted string changed");
@@ -25,20 +25,41 @@
 #include <stdlib.h>
 #include <stdarg.h>
 
+struct strbuf;
+
+/* Optional allocator. alloc() follows the lua_Alloc convention:
+ * nsize == 0 frees ptr, otherwise ptr is resized from osize to nsize
+ * bytes and NULL is returned on failure. error() is called after a
+ * failed allocation and must not return. */
+typedef void *(*strbuf_alloc_fn)(void *ud, void *ptr, size_t osize,
+                                 size_t nsize);
+
+typedef struct {
+    strbuf_alloc_fn alloc;
+    void *ud;
+    void (*error)(void *ctx, struct strbuf *s);
+    void *ctx;
+} strbuf_alloc_t;
+
 /* Size: Total bytes allocated to *buf
  * Length: String length, excluding optional NULL terminator.
  * Increment: Allocation increments when resizing the string buffer.
  * Dynamic: True if created via strbuf_new()
+ * Reallocs: Number of times the buffer has been resized
+ * Peak: Largest size allocated to *buf
+ * Alloc: Allocator, or NULL to use malloc() and exit on failure.
  */
 
-typedef struct {
+typedef struct strbuf {
     char *buf;
-    int size;
-    int length;
+    size_t size;
+    size_t length;
     int increment;
     int dynamic;
     int reallocs;
+    size_t peak;
     int debug;
+    strbuf_alloc_t *alloc;
 } strbuf_t;
 
 #ifndef STRBUF_DEFAULT_SIZE
@@ -49,27 +70,31 @@ typedef struct {
 #endif
 
 /* Initialise */
-extern strbuf_t *strbuf_new(int len);
-extern void strbuf_init(strbuf_t *s, int len);
+extern strbuf_t *strbuf_new(size_t len);
+extern void strbuf_init(strbuf_t *s, size_t len);
+extern strbuf_t *strbuf_new_alloc(size_t len, strbuf_alloc_t *alloc);
+extern void strbuf_init_alloc(strbuf_t *s, size_t len, strbuf_alloc_t *alloc);
 extern void strbuf_set_increment(strbuf_t *s, int increment);
 
 /* Release */
 extern void strbuf_free(strbuf_t *s);
-extern char *strbuf_free_to_string(strbuf_t *s, int *len);
+extern char *strbuf_free_to_string(strbuf_t *s, size_t *len);  /* malloc() only */
 
 /* Management */
-extern void strbuf_resize(strbuf_t *s, int len);
-static int strbuf_empty_length(strbuf_t *s);
-static int strbuf_length(strbuf_t *s);
-static char *strbuf_string(strbuf_t *s, int *len);
-static void strbuf_ensure_empty_length(strbuf_t *s, int len);
+extern void strbuf_resize(strbuf_t *s, size_t len);
+extern void strbuf_grow(strbuf_t *s, size_t len);
+static size_t strbuf_empty_length(strbuf_t *s);
+static size_t strbuf_length(strbuf_t *s);
+static char *strbuf_string(strbuf_t *s, size_t *len);
+static void strbuf_ensure_empty_length(strbuf_t *s, size_t len);
 static char *strbuf_empty_ptr(strbuf_t *s);
-static void strbuf_extend_length(strbuf_t *s, int len);
+static void strbuf_extend_length(strbuf_t *s, size_t len);
+static void strbuf_set_length(strbuf_t *s, size_t len);
 
 /* Update */
-extern void strbuf_append_fmt(strbuf_t *s, int len, const char *fmt, ...);
+extern void strbuf_append_fmt(strbuf_t *s, size_t len, const char *fmt, ...);
 extern void strbuf_append_fmt_retry(strbuf_t *s, const char *format, ...);
-static void strbuf_append_mem(strbuf_t *s, const char *c, int len);
+static void strbuf_append_mem(strbuf_t *s, const char *c, size_t len);
 extern void strbuf_append_string(strbuf_t *s, const char *str);
 static void strbuf_append_char(strbuf_t *s, const char c);
 static void strbuf_ensure_null(strbuf_t *s);
@@ -87,15 +112,16 @@ static inline int strbuf_allocated(strbuf_t *s)
 
 /* Return bytes remaining in the string buffer
  * Ensure there is space for a NULL terminator. */
-static inline int strbuf_empty_length(strbuf_t *s)
+static inline size_t strbuf_empty_length(strbuf_t *s)
 {
-    return s->size - s->length - 1;
+    return s->size > s->length ? s->size - s->length - 1 : 0;
 }
 
-static inline void strbuf_ensure_empty_length(strbuf_t *s, int len)
+/* Unallocated buffers have a size of 0, and always grow */
+static inline void strbuf_ensure_empty_length(strbuf_t *s, size_t len)
 {
-    if (len > strbuf_empty_length(s))
-        strbuf_resize(s, s->length + len);
+    if (len >= s->size - s->length)
+        strbuf_grow(s, len);
 }
 
 static inline char *strbuf_empty_ptr(strbuf_t *s)
@@ -103,16 +129,22 @@ static inline char *strbuf_empty_ptr(strbuf_t *s)
     return s->buf + s->length;
 }
 
-static inline void strbuf_extend_length(strbuf_t *s, int len)
+static inline void strbuf_extend_length(strbuf_t *s, size_t len)
 {
     s->length += len;
 }
 
-static inline int strbuf_length(strbuf_t *s)
+static inline size_t strbuf_length(strbuf_t *s)
 {
     return s->length;
 }
 
+/* Discard everything after the first len bytes */
+static inline void strbuf_set_length(strbuf_t *s, size_t len)
+{
+    s->length = len;
+}
+
 static inline void strbuf_append_char(strbuf_t *s, const char c)
 {
     strbuf_ensure_empty_length(s, 1);
@@ -124,14 +156,14 @@ static inline void strbuf_append_char_unsafe(strbuf_t *s, const char c)
     s->buf[s->length++] = c;
 }
 
-static inline void strbuf_append_mem(strbuf_t *s, const char *c, int len)
+static inline void strbuf_append_mem(strbuf_t *s, const char *c, size_t len)
 {
     strbuf_ensure_empty_length(s, len);
     memcpy(s->buf + s->length, c, len);
     s->length += len;
 }
 
-static inline void strbuf_append_mem_unsafe(strbuf_t *s, const char *c, int len)
+static inline void strbuf_append_mem_unsafe(strbuf_t *s, const char *c, size_t len)
 {
     memcpy(s->buf + s->length, c, len);
     s->length += len;
@@ -142,7 +174,7 @@ static inline void strbuf_ensure_null(strbuf_t *s)
     s->buf[s->length] = 0;
 }
 
-static inline char *strbuf_string(strbuf_t *s, int *len)
+static inline char *strbuf_string(strbuf_t *s, size_t *len)
 {
     if (len)
         *len = s->length;
@@ -96,6 +96,36 @@ function benchmark(tests, seconds, rep)
     return test_results
 end
 
+-- Pretty print a decoded value with 4 space indentation. Used to
+-- compare decoding performance of whitespace heavy JSON.
+local function indent_json(value, indent)
+    if type(value) ~= "table" then
+        return json_encode(value)
+    end
+
+    local inner = indent .. "    "
+    local fragment = {}
+    local open, close
+    if #value > 0 then
+        open, close = "[", "]"
+        for i = 1, #value do
+            fragment[i] = inner .. indent_json(value[i], inner)
+        end
+    else
+        open, close = "{", "}"
+        for k, v in pairs(value) do
+            fragment[#fragment + 1] = ("%s%s: %s"):format(
+                inner, json_encode(tostring(k)), indent_json(v, inner))
+        end
+    end
+    if #fragment == 0 then
+        return open .. close
+    end
+
+    return open .. "\n" .. table.concat(fragment, ",\n") .. "\n" ..
+           indent .. close
+end
+
 function bench_file(filename)
     local data_json = util.file_load(filename)
     local data_obj = json_decode(data_json)
@@ -111,6 +141,73 @@ function bench_file(filename)
     if json_encode then tests.encode = test_encode end
     if json_decode then tests.decode = test_decode end
 
+    -- Compare minified and indented copies of the same document
+    if json_encode and json_decode then
+        local data_minified = json_encode(data_obj)
+        local data_indented = indent_json(data_obj, "")
+
+        tests.decode_minified = function ()
+            json_decode(data_minified)
+        end
+        tests.decode_indented = function ()
+            json_decode(data_indented)
+        end
+    end
+
+    -- Measure the rehashing avoided by presizing decoded tables
+    if json.decode_presize_tables then
+        tests.decode_presized = function ()
+            json.decode_presize_tables(true)
+            json_decode(data_json)
+            json.decode_presize_tables(false)
+        end
+    end
+
+    -- Measure indexing a document without decoding its values
+    if json.view then
+        tests.view = function ()
+            local view = json.view(data_json)
+            if type(view) == "userdata" then
+                local _ = #view
+            end
+        end
+    end
+
+    return benchmark(tests, 0.1, 5)
+end
+
+-- Large generated documents, where presizing avoids rehashing each
+-- table as it grows
+local function generate_documents(count)
+    local values, members, records = {}, {}, {}
+    for i = 1, count do
+        values[i] = tostring(i)
+        members[i] = ('"key%d":%d'):format(i, i)
+        records[i] = ('{"id":%d,"name":"item%d","tags":["a","b"]}'):format(i, i)
+    end
+
+    return {
+        { ("array %d"):format(count), "[" .. table.concat(values, ",") .. "]" },
+        { ("object %d"):format(count), "{" .. table.concat(members, ",") .. "}" },
+        { ("records %d"):format(count), "[" .. table.concat(records, ",") .. "]" },
+    }
+end
+
+function bench_generated(data_json)
+    local tests = {
+        decode = function ()
+            json_decode(data_json)
+        end
+    }
+
+    if json.decode_presize_tables then
+        tests.decode_presized = function ()
+            json.decode_presize_tables(true)
+            json_decode(data_json)
+            json.decode_presize_tables(false)
+        end
+    end
+
     return benchmark(tests, 0.1, 5)
 end
 
@@ -128,4 +225,13 @@ for i = 1, #arg do
     end
 end
 
+if json_decode then
+    for _, doc in ipairs(generate_documents(100000)) do
+        local results = bench_generated(doc[2])
+        for k, v in pairs(results) do
+            print(("%s\t%s\t%d"):format(doc[1], k, v))
+        end
+    end
+end
+
 -- vi:ai et sw=4 ts=4:
@@ -0,0 +1,88 @@
+#!/usr/bin/env lua
+
+-- Encode and decode documents larger than 2 GiB to check that lengths
+-- and positions which do not fit in an int are handled. Throughput is
+-- reported for each step.
+--
+-- This needs around twice the document size in free memory, so it is
+-- not run by test.lua.
+--
+-- Usage: ./large.lua [megabytes]
+
+local json = require "cjson"
+
+local unpack = unpack or table.unpack
+
+local MiB = 1024 * 1024
+local size = tonumber(arg[1]) or 2100
+local failed = false
+
+local function check(name, ok)
+    print(("==> %s: %s"):format(name, ok and "PASS" or "FAIL"))
+    if not ok then
+        failed = true
+    end
+end
+
+local function timed(name, bytes, func, ...)
+    local t = os.clock()
+    local result = { func(...) }
+    t = os.clock() - t
+    print(("%s\t%.0f MB/s"):format(name, bytes / t / 1e6))
+    return unpack(result)
+end
+
+-- Avoid holding a copy of the output in the persistent buffer
+json.encode_keep_buffer(false)
+
+-- An array of 1 MiB elements: '"xxx..",'
+local chunk = string.rep("x", MiB - 3)
+local values = {}
+for i = 1, size do
+    values[i] = chunk
+end
+
+local text = timed("encode", size * MiB, json.encode, values)
+values = nil
+collectgarbage()
+check("Encode array", #text == size * MiB + 1)
+
+local decoded = timed("decode", #text, json.decode, text)
+check("Decode array", #decoded == size and decoded[size] == chunk)
+decoded = nil
+collectgarbage()
+
+-- Remove the closing bracket so the error is reported at the end
+local ok, err = pcall(json.decode, text, 1, -2)
+check("Decode error position",
+      not ok and err:match("at character (%d+)$") == tostring(#text))
+text = nil
+collectgarbage()
+
+-- A single string value, decoded from a file and streamed back out
+local filename = os.tmpname()
+local fh = assert(io.open(filename, "wb"))
+local mib = string.rep("x", MiB)
+fh:write('"')
+for i = 1, size do
+    fh:write(mib)
+end
+fh:write('"')
+fh:close()
+
+local str = timed("decode_file", size * MiB + 2, json.decode_file, filename)
+check("Decode string from file", #str == size * MiB and str:sub(-1) == "x")
+
+fh = assert(io.open(filename, "wb"))
+local written = timed("encode_to", #str, json.encode_to, str, fh)
+fh:close()
+os.remove(filename)
+check("Encode string to file", written == size * MiB + 2)
+
+if failed then
+    print("==> Summary: some tests failed")
+    os.exit(1)
+end
+print("==> Summary: all tests succeeded")
+
+-- vi:ai et sw=4 ts=4:
@@ -21,6 +21,64 @@ local function json_encode_output_type(value)
     end
 end
 
+-- Encode to a sink collecting the output. Returns the output, the
+-- number of chunks written and the byte count returned by encode_to()
+local function json_encode_to_string(value)
+    local chunks = {}
+    local written = json.encode_to(value, function (chunk)
+        chunks[#chunks + 1] = chunk
+    end)
+    return table.concat(chunks), #chunks, written
+end
+
+-- Feed text to an incremental decoder in chunks of "size" bytes.
+-- Returns every value decoded.
+local function json_decode_chunks(text, size)
+    local decoder = json.decoder()
+    local values = {}
+    for i = 1, #text, size do
+        local value = decoder:feed(text:sub(i, i + size - 1))
+        while value ~= nil do
+            values[#values + 1] = value
+            value = decoder:feed()
+        end
+    end
+    values[#values + 1] = decoder:finish()
+    return values
+end
+
+-- Decode text via a temporary file
+local function json_decode_temp_file(text)
+    local path = os.tmpname()
+    local file = assert(io.open(path, "wb"))
+    file:write(text)
+    file:close()
+    local success, value = pcall(json.decode_file, path)
+    os.remove(path)
+    if not success then
+        error(value, 0)
+    end
+    return value
+end
+
+-- Read a value through cjson.view() by following a list of keys.
+-- Errors are raised without position information like other decoding
+-- errors.
+local function json_view_path(text, ...)
+    local keys = { ... }
+    local success, value = pcall(function ()
+        local value = json.view(text)
+        for _, key in ipairs(keys) do
+            value = value[key]
+        end
+        return value
+    end)
+    if not success then
+        error((value:gsub("^[^:]*:%d+: ", "")), 0)
+    end
+    return value
+end
+
 local function gen_raw_octets()
     local chars = {}
     for i = 0, 255 do chars[i + 1] = string.char(i) end
@@ -94,6 +152,12 @@ function test_decode_cycle(filename)
     return util.compare_values(obj1, obj2)
 end
 
+function test_decode_file(filename)
+    local obj1 = json.decode(util.file_load(filename))
+    local obj2 = json.decode_file(filename)
+    return util.compare_values(obj1, obj2)
+end
+
 -- Set up data used in tests
 local Inf = math.huge;
 local NaN = math.huge * 0;
@@ -109,9 +173,17 @@ local cjson_tests = {
     -- Test decoding simple types
     { "Decode string",
       json.decode, { '"test string"' }, true, { "test string" } },
+    { "Decode long string with escapes",
+      json.decode, { '"' .. string.rep("a", 40) .. '\\n' .. string.rep("b", 40) ..
+                     '\\u00e9\\"' .. string.rep("c", 17) .. '"' },
+      true, { string.rep("a", 40) .. "\n" .. string.rep("b", 40) ..
+              "\195\169\"" .. string.rep("c", 17) } },
     { "Decode numbers",
       json.decode, { '[ 0.0, -5e3, -1, 0.3e-3, 1023.2, 0e10 ]' },
       true, { { 0.0, -5000, -1, 0.0003, 1023.2, 0 } } },
+    { "Decode integers",
+      json.decode, { '[ 0, -0, 7, -42, 999999999999999999, 12345678901234567890 ]' },
+      true, { { 0, -0, 7, -42, 999999999999999999, 12345678901234567890 } } },
     { "Decode null",
       json.decode, { 'null' }, true, { json.null } },
     { "Decode true",
@@ -127,6 +199,42 @@ local cjson_tests = {
     { "Decode array",
       json.decode, { '[ "one", null, "three" ]' },
       true, { { "one", json.null, "three" } } },
+    { "Decode with long whitespace runs",
+      json.decode, { "[\n" .. string.rep(" ", 40) .. "1,\t\r\n" ..
+                     string.rep(" ", 33) .. "2" .. string.rep("\n", 70) .. "]" },
+      true, { { 1, 2 } } },
+
+    -- Test decoding part of a string
+    { "Decode range",
+      json.decode, { 'xx[1,"two"]yy', 3, 11 }, true, { { 1, "two" } } },
+    { "Decode range with negative positions",
+      json.decode, { '{"a":true}\n', 1, -2 }, true, { { a = true } } },
+    { "Decode range ending within an integer",
+      json.decode, { '12345', 1, 3 }, true, { 123 } },
+    { "Decode range ending within a number",
+      json.decode, { '[0.25]0.125', 7, 10 }, true, { 0.12 } },
+    { "Decode range ending within a literal [throw error]",
+      json.decode, { 'trueish', 1, 3 },
+      false, { "Expected value but found invalid token at character 1" } },
+    { "Decode range ending within a string [throw error]",
+      json.decode, { '["abc"]', 1, 5 },
+      false, { "Expected value but found unexpected end of string at character 6" } },
+    { "Decode range ending within a unicode escape [throw error]",
+      json.decode, { '"\\u00e9"', 1, 6 },
+      false, { "Expected value but found invalid unicode escape code at character 2" } },
+    { "Decode empty range [throw error]",
+      json.decode, { '[1]', 3, 2 },
+      false, { "Expected value but found T_END at character 3" } },
+    { "Decode range with error position in string [throw error]",
+      json.decode, { 'xx[1,}', 3 },
+      false, { "Expected value but found T_OBJ_END at character 6" } },
+    { "Decode (safe) range",
+      json_safe.decode, { 'xx1yy', 3, 3 }, true, { 1 } },
+    { "Decode string with NULL characters",
+      json.decode, { '["a\0b"]' }, true, { { "a\0b" } } },
+    { "Decode trailing NULL character [throw error]",
+      json.decode, { '[1]\0' },
+      false, { "Expected the end but found invalid token at character 4" } },
 
     -- Test decoding errors
     { "Decode UTF-16BE [throw error]",
@@ -187,6 +295,173 @@ local cjson_tests = {
       json.decode, { string.rep("[", 1100) .. '1100' .. string.rep("]", 1100)},
       false, { "Found too many nested data structures (1001) at character 1001" } },
 
+    -- Test decoding with presized tables
+    { "Set decode_presize_tables(true)",
+      json.decode_presize_tables, { true }, true, { true } },
+    { "Decode arrays and objects with size hints",
+      function (s)
+          local a, b = json.decode(s), json.decode(s)
+          return a, b
+      end, { '[[1,2,3],{"a":1,"b":2},[],[4],{"c":[5,6]}]' },
+      true, { { {1,2,3},{a=1,b=2},{},{4},{c={5,6}} },
+              { {1,2,3},{a=1,b=2},{},{4},{c={5,6}} } } },
+    { "Decode nested array with stale size hint",
+      json.decode, { '[[1,2,3,4,5,6,7,8],[9]]' },
+      true, { { {1,2,3,4,5,6,7,8},{9} } } },
+    { "Set decode_presize_tables(false)",
+      json.decode_presize_tables, { false }, true, { false } },
+
+    -- Test incremental decoding
+    { "Decode object fed one byte at a time",
+      json_decode_chunks, { '{ "a": [1, "x\\"]}", 2.5e3], "b": {} }', 1 },
+      true, { { { a = { 1, 'x"]}', 2500 }, b = {} } } } },
+    { "Decode concatenated values in chunks",
+      json_decode_chunks, { '[1] {"b":true}"s" 12 null\n-3', 4 },
+      true, { { { 1 }, { b = true }, "s", 12, json.null, -3 } } },
+    { "Decode value split across chunks",
+      function ()
+          local decoder = json.decoder()
+          return decoder:feed('[ "par'), decoder:feed('tial" ]')
+      end, { }, true, { nil, { "partial" } } },
+    { "Decode large value fed in many chunks",
+      function ()
+          local items = {}
+          for i = 1, 10000 do
+              items[i] = ('{"id":%d,"s":"a\\"b\\\\%d"}'):format(i, i)
+          end
+          local text = "[" .. table.concat(items, ",") .. "] 7"
+          local values = json_decode_chunks(text, 97)
+          local last = values[1][10000]
+          return #values, #values[1], last.id, last.s, values[2]
+      end, { }, true, { 2, 10000, 10000, 'a"b\\10000', 7 } },
+    { "Decode invalid value in chunks [throw error]",
+      json_decode_chunks, { '[1, 2}', 3 },
+      false, { "Expected comma or array end but found T_OBJ_END at character 6" } },
+    { "Decode incomplete value in chunks [throw error]",
+      json_decode_chunks, { '{"a":', 3 },
+      false, { "Expected value but found T_END at character 6" } },
+
+    -- Test decoding multiple values
+    { "Decode many values",
+      json.decode_many, { '{"a":1}\n[2,3]\n"four"\n5\nnull\n' },
+      true, { { { a = 1 }, { 2, 3 }, "four", 5, json.null } } },
+    { "Decode many values from empty input",
+      json.decode_many, { ' \n' }, true, { { } } },
+    { "Decode many values with limit",
+      json.decode_many, { '1 2\n3 4', 3 }, true, { { 1, 2, 3 }, 7 } },
+    { "Decode many values with invalid value [throw error]",
+      json.decode_many, { '[1]\n[2,]\n' },
+      false, { "Expected value but found T_ARR_END at character 8" } },
+    { "Decode (safe) many values with invalid value",
+      json_safe.decode_many, { '[1]\n[2,]\n' },
+      true, { nil, "Expected value but found T_ARR_END at character 8" } },
+
+    -- Test decoding files
+    { "Decode file",
+      json_decode_temp_file, { '{"a":[1,"two\\n"]}\n' },
+      true, { { a = { 1, "two\n" } } } },
+    { "Decode file with page aligned size",
+      json_decode_temp_file, { '"' .. string.rep("x", 65534) .. '"' },
+      true, { string.rep("x", 65534) } },
+    { "Decode empty file [throw error]",
+      json_decode_temp_file, { "" },
+      false, { "Expected value but found T_END at character 1" } },
+    { "Decode invalid file [throw error]",
+      json_decode_temp_file, { '[1, 2}' },
+      false, { "Expected comma or array end but found T_OBJ_END at character 6" } },
+    { "Decode missing file [throw error]",
+      json.decode_file, { "missing.json" },
+      false, { "Cannot open missing.json: No such file or directory" } },
+    { "Decode (safe) missing file",
+      json_safe.decode_file, { "missing.json" },
+      true, { nil, "Cannot open missing.json: No such file or directory" } },
+
+    -- Test decoding through views
+    { "Decode view field",
+      json_view_path, { '{"a":1,"b":[true,{"c":"x\\ny"}]}', "b", 2, "c" },
+      true, { "x\ny" } },
+    { "Decode view missing field",
+      json_view_path, { '{"a":1}', "b" }, true, { nil } },
+    { "Decode view null field",
+      json_view_path, { '[null]', 1 }, true, { json.null } },
+    { "Decode view length",
+      function () return #json.view(' [1, [2, 3], {}] ') end, { },
+      true, { 3 } },
+    { "Decode view pairs",
+      function ()
+          local values = {}
+          for k, v in json.view_pairs(json.view('{"a":1,"b":"two","c":null}')) do
+              values[k] = v
+          end
+          return values
+      end, { }, true, { { a = 1, b = "two", c = json.null } } },
+    { "Decode view returns the same nested view",
+      function ()
+          local view = json.view('{"a":{"b":1}}')
+          return view.a == view.a, view.a.b
+      end, { }, true, { true, 1 } },
+    { "Decode view of a scalar",
+      json.view, { ' "text" ' }, true, { "text" } },
+    { "Decode view with invalid nested value [throw error]",
+      json_view_path, { '{"a":[1,tru]}', "a", 2 },
+      false, { "Expected value but found invalid token at character 9" } },
+    { "Decode view with invalid number [throw error]",
+      json_view_path, { '{"a":12x}', "a" },
+      false, { "Expected comma or object end but found invalid token at character 8" } },
+    { "Decode view with unterminated array [throw error]",
+      json_view_path, { '{"a":[1,2', "a" },
+      false, { "Expected comma or array end but found T_END at character 10" } },
+    { "Decode view with mismatched bracket in a sibling [throw error]",
+      json_view_path, { '{"a":[1}, "b":2}', "b" },
+      false, { "Expected comma or array end but found T_OBJ_END at character 8" } },
+    { "Decode view with trailing text [throw error]",
+      json_view_path, { '{"a":1} x', "a" },
+      false, { "Expected the end but found invalid token at character 9" } },
+    { "Decode (safe) view of invalid scalar",
+      json_safe.view, { 'oops' },
+      true, { nil, "Expected value but found invalid token at character 1" } },
+
+    -- Test decoding JSON Pointers
+    { "Decode path",
+      json.decode_path, { '{"data":{"items":[{"id":1},{"id":2,"x":[3]}]}}',
+                          "/data/items/1/id" },
+      true, { 2 } },
+    { "Decode path to a table",
+      json.decode_path, { '{"a":[1,{"b":null}],"c":2}', "/a" },
+      true, { { 1, { b = json.null } } } },
+    { "Decode path with escaped tokens",
+      json.decode_path, { '{"a/b":{"m~n":1}}', "/a~1b/m~0n" }, true, { 1 } },
+    { "Decode path to the whole document",
+      json.decode_path, { '[1,2]', "" }, true, { { 1, 2 } } },
+    { "Decode missing paths",
+      function (text)
+          return json.decode_path(text, "/a/5"),
+                 json.decode_path(text, "/a/-"),
+                 json.decode_path(text, "/a/01"),
+                 json.decode_path(text, "/b/c")
+      end, { '{"a":[1],"b":"c"}' }, true, { nil, nil, nil, nil } },
+    { "Decode path stops after the value is found",
+      json.decode_path, { '{"a":1,"b":[}', "/a" }, true, { 1 } },
+    { "Decode path with invalid JSON [throw error]",
+      json.decode_path, { '{"a":1,"b":[}', "/c" },
+      false, { "Expected comma or array end but found T_OBJ_END at character 13" } },
+    { "Decode path with mismatched bracket in a skipped value [throw error]",
+      json.decode_path, { '{"a":[1}, "b":2}', "/b" },
+      false, { "Expected comma or array end but found T_OBJ_END at character 8" } },
+    { "Decode path with invalid pointer [throw error]",
+      json.decode_path, { '{}', "a" },
+      false, { "bad argument #2 to '?' (invalid JSON pointer)" } },
+    { "Decode paths",
+      json.decode_paths, { '{"a":{"b":1,"c":[2,3]},"d":"e"}',
+                           { "/a/c/1", "/d", "/x", "/a/b" } },
+      true, { { 3, "e", nil, 1 } } },
+    { "Decode nested paths",
+      json.decode_paths, { '{"a":{"b":1}}', { "/a", "/a/b" } },
+      true, { { { b = 1 }, 1 } } },
+    { "Decode (safe) path with invalid JSON",
+      json_safe.decode_path, { '{"a":tru}', "/a" },
+      true, { nil, "Expected value but found invalid token at character 6" } },
+
     -- Test encoding nested tables
     { "Set encode_max_depth(5)",
       json.encode_max_depth, { 5 }, true, { 5 } },
@@ -221,8 +496,16 @@ local cjson_tests = {
       json.encode, { { } }, true, { '{}' } },
     { "Encode integer",
       json.encode, { 10 }, true, { '10' } },
+    { "Encode integers",
+      json.encode, { { 0, -7, 1099511627776, -99999999999999, 1e14, 0.5 } },
+      true, { '[0,-7,1099511627776,-99999999999999,1e+14,0.5]' } },
     { "Encode string",
       json.encode, { "hello" }, true, { '"hello"' } },
+    { "Encode long string with escapes",
+      json.encode, { string.rep("a", 15) .. "\n" .. string.rep("b", 16) .. '"' ..
+                     string.rep("c", 40) .. "</" .. string.rep("d", 17) },
+      true, { '"' .. string.rep("a", 15) .. '\\n' .. string.rep("b", 16) .. '\\"' ..
+              string.rep("c", 40) .. '<\\/' .. string.rep("d", 17) .. '"' } },
     { "Encode Lua function [throw error]",
       json.encode, { function () end },
       false, { "Cannot serialise function: type not supported" } },
@@ -305,6 +588,27 @@ local cjson_tests = {
     { "Encode sparse array as object",
       json_encode_output_type, { { [1] = "one", [5] = "sparse test" } },
       true, { 'object' } },
+    { "Encode array with hole",
+      json.encode, { { 1, 2, nil, 4 } }, true, { '[1,2,null,4]' } },
+    { "Encode array with string key as object",
+      json_encode_output_type, { { 1, 2, 3, key = "value" } },
+      true, { 'object' } },
+    { "Encode nested tables with late string keys",
+      function (depth)
+          -- Iterates as 1, k7, 2, passing the border check. Each level
+          -- must not repeat the speculative work of the levels below.
+          local t = true
+          for i = 1, depth do
+              t = { [1] = t, k7 = true, [2] = true }
+          end
+          local levels = 0
+          t = json.decode(json.encode(t))
+          while type(t) == "table" and t.k7 do
+              levels = levels + 1
+              t = t["1"]
+          end
+          return levels, t
+      end, { 40 }, true, { 40, true } },
     { "Encode table with numeric string key as object",
       json.encode, { { ["2"] = "numeric string key test" } },
       true, { '{"2":"numeric string key test"}' } },
@@ -314,6 +618,38 @@ local cjson_tests = {
       json.encode, { { [false] = "wrong" } },
       false, { "Cannot serialise boolean: table key must be a number or string" } },
 
+    -- Test array / object type markers
+    { "Encode empty table marked as array",
+      json.encode, { setmetatable({ }, json.array_mt) }, true, { '[]' } },
+    { "Encode array marked as object",
+      json.encode, { setmetatable({ "one", "two" }, json.object_mt) },
+      true, { '{"1":"one","2":"two"}' } },
+    { "Encode nested tables marked as array",
+      json.encode, { { setmetatable({ }, json.array_mt),
+                       setmetatable({ true, nil, false }, json.array_mt) } },
+      true, { '[[],[true,null,false]]' } },
+    { "Check cjson.safe uses the same type markers",
+      function () return json_safe.array_mt == json.array_mt,
+                         json_safe.object_mt == json.object_mt end,
+      { }, true, { true, true } },
+    { "Set decode_type_markers(true)",
+      json.decode_type_markers, { true }, true, { true } },
+    { "Decode arrays and objects with type markers",
+      function (s)
+          local t = json.decode(s)
+          return getmetatable(t) == json.array_mt,
+                 getmetatable(t[1]) == json.object_mt,
+                 getmetatable(t[2]) == json.array_mt
+      end, { '[{},[]]' }, true, { true, true, true } },
+    { "Encode decoded empty objects and arrays",
+      function (s) return json.encode(json.decode(s)) end,
+      { '[{},[],{"a":[]}]' }, true, { '[{},[],{"a":[]}]' } },
+    { "Set decode_type_markers(false)",
+      json.decode_type_markers, { false }, true, { false } },
+    { "Decode without type markers",
+      function (s) return getmetatable(json.decode(s)) end,
+      { '[]' }, true, { nil } },
+
     -- Test escaping
     { "Encode all octets (8-bit clean)",
       json.encode, { testdata.octets_raw }, true, { testdata.octets_escaped } },
@@ -339,6 +675,96 @@ local cjson_tests = {
       json.decode, { [["\uDB00\uD"]] },
       false, { "Expected value but found invalid unicode escape code at character 2" } },
 
+    -- Test encode_to()
+    { "Set encode_chunk_size(8)",
+      json.encode_chunk_size, { 8 }, true, { 8 } },
+    { "Encode to function sink",
+      json_encode_to_string, { { "one", { 2, 3 }, { a = true }, json.null } },
+      true, { '["one",[2,3],{"a":true},null]', 3, 29 } },
+    { "Encode scalar to function sink",
+      json_encode_to_string, { "hello" }, true, { '"hello"', 1, 7 } },
+    { "Encode to object with write method",
+      function (value)
+          local sink = { buf = {} }
+          function sink:write(chunk) self.buf[#self.buf + 1] = chunk; return self end
+          local written = json.encode_to(value, sink)
+          return table.concat(sink.buf), written
+      end, { { 1, 2, 3, 4, 5, 6, 7, 8, 9, 10 } },
+      true, { '[1,2,3,4,5,6,7,8,9,10]', 22 } },
+    { "Encode to sink which encodes",
+      function (value)
+          local chunks = {}
+          json.encode_to(value, function (chunk)
+              chunks[#chunks + 1] = json.decode(json.encode(chunk))
+          end)
+          return table.concat(chunks), #chunks
+      end, { { "abcdefgh", "ijklmnop" } },
+      true, { '["abcdefgh","ijklmnop"]', 3 } },
+    { "Encode to failing sink [throw error]",
+      json.encode_to, { { 1, 2, 3 }, function () return nil, "disk full" end },
+      false, { "Cannot write to sink: disk full" } },
+    { "Encode to invalid sink [throw error]",
+      json.encode_to, { { 1, 2, 3 }, 42 },
+      false, { "bad argument #2 to '?' (expected function or object with write method)" } },
+    { "Encode (safe) to failing sink",
+      json_safe.encode_to, { { 1, 2, 3 }, function () error("closed", 0) end },
+      true, { nil, "closed" } },
+    { "Encode lines",
+      json.encode_lines, { { { a = 1 }, "two", 3, { 4, 5 } } },
+      true, { '{"a":1}\n"two"\n3\n[4,5]\n' } },
+    { "Encode no lines",
+      json.encode_lines, { { } }, true, { "" } },
+    { "Encode lines to function sink",
+      function (values)
+          local chunks = {}
+          local written = json.encode_lines(values, function (chunk)
+              chunks[#chunks + 1] = chunk
+          end)
+          return table.concat(chunks), #chunks, written
+      end, { { "abcdefgh", true, { b = false } } },
+      true, { '"abcdefgh"\ntrue\n{"b":false}\n', 3, 28 } },
+    { "Encode lines with invalid value [throw error]",
+      json.encode_lines, { { 1, function () end } },
+      false, { "Cannot serialise function: type not supported" } },
+    { "Set encode_segmented(true)",
+      json.encode_segmented, { true }, true, { true } },
+    { "Encode segmented",
+      json.encode, { { "abcdefghijkl", { 1, 2, 3 }, { a = "mnop" }, json.null } },
+      true, { '["abcdefghijkl",[1,2,3],{"a":"mnop"},null]' } },
+    { "Encode segmented string larger than chunk",
+      json.encode, { string.rep("x", 100) },
+      true, { '"' .. string.rep("x", 100) .. '"' } },
+    { "Encode segmented lines",
+      json.encode_lines, { { { a = 1 }, "two", 3, { 4, 5 } } },
+      true, { '{"a":1}\n"two"\n3\n[4,5]\n' } },
+    { "Encode to function sink with encode_segmented",
+      json_encode_to_string, { { "abcdefgh", "ijklmnop" } },
+      true, { '["abcdefgh","ijklmnop"]', 3, 23 } },
+    { "Encode segmented with invalid value [throw error]",
+      json.encode, { { "abcdefghijkl", "mnopqrst", function () end } },
+      false, { "Cannot serialise function: type not supported" } },
+    { "Encode segmented after error",
+      json.encode, { { "abcdefghijkl", "mnopqrst" } },
+      true, { '["abcdefghijkl","mnopqrst"]' } },
+    { "Encode segmented large array in chunks",
+      function ()
+          local values = {}
+          for i = 1, 20000 do
+              values[i] = "abcdefgh"
+          end
+          json.encode_chunk_size(1024)
+          local text = json.encode(values)
+          json.encode_chunk_size(8)
+          local stats = json.buffer_stats().segmented
+          -- Chunks are pushed as the array is encoded, so the buffers
+          -- do not grow with the output
+          return #text, stats.chunks > 100, stats.reallocs <= 20
+      end, { }, true, { 220001, true, true } },
+    { "Set encode_segmented(false)",
+      json.encode_segmented, { false }, true, { false } },
+    { "Set encode_chunk_size(65536)",
+      json.encode_chunk_size, { 65536 }, true, { 65536 } },
+
     -- Test locale support
     --
     -- The standard Lua interpreter is ANSI C online doesn't support locales
@@ -358,27 +784,129 @@ local cjson_tests = {
 
     -- Test encode_keep_buffer() and enable_number_precision()
     { "Set encode_keep_buffer(false)",
-      json.encode_keep_buffer, { false }, true, { false } },
+      json.encode_keep_buffer, { false }, true, { false, 1048576, 0 } },
     { "Set encode_number_precision(3)",
       json.encode_number_precision, { 3 }, true, { 3 } },
     { "Encode number with precision 3",
       json.encode, { 1/3 }, true, { "0.333" } },
+    { "Set encode_number_precision(17)",
+      json.encode_number_precision, { 17 }, true, { 17 } },
+    { "Encode and decode number with precision 17",
+      function (n) return json.decode(json.encode(n)) == n end,
+      { 1/3 }, true, { true } },
     { "Set encode_number_precision(14)",
       json.encode_number_precision, { 14 }, true, { 14 } },
-    { "Set encode_keep_buffer(true)",
-      json.encode_keep_buffer, { true }, true, { true } },
+    { "Set encode_keep_buffer(true, 16)",
+      json.encode_keep_buffer, { true, 16 }, true, { true, 16, 0 } },
+    { "Encode string over the buffer limit",
+      json.encode, { string.rep("a", 40) },
+      true, { '"' .. string.rep("a", 40) .. '"' } },
+    { "Encode after trimming the buffer",
+      json.encode, { { "b", "c" } }, true, { '["b","c"]' } },
+    { "Encode invalid value over the buffer limit [throw error]",
+      json.encode, { { string.rep("d", 40), function () end } },
+      false, { "Cannot serialise function: type not supported" } },
+    { "Encode lines after trimming the buffer",
+      json.encode_lines, { { string.rep("e", 40), 1 } },
+      true, { '"' .. string.rep("e", 40) .. '"\n1\n' } },
+    { "Set encode_keep_buffer(true, 16, 2)",
+      json.encode_keep_buffer, { true, 16, 2 }, true, { true, 16, 2 } },
+    { "Trim encode buffer after 2 calls within the limit",
+      function ()
+          json.encode(string.rep("a", 40))
+          local large = json.buffer_stats().encode
+          json.encode(1)
+          local kept = json.buffer_stats().encode.size
+          json.encode(1)
+          local trimmed = json.buffer_stats().encode
+          return large.size > 17, kept == large.size,
+                 trimmed.size, trimmed.peak >= large.size
+      end, { }, true, { true, true, 17, true } },
+    { "Trim encode buffer while reading the settings",
+      function ()
+          json.encode(string.rep("a", 4000))
+          json.encode(1)
+          json.encode_keep_buffer()
+          json.encode(1)
+          return json.buffer_stats().encode.size
+      end, { }, true, { 17 } },
+    { "Set encode_keep_buffer(true, 1048576, 0)",
+      json.encode_keep_buffer, { true, 1048576, 0 }, true, { true, 1048576, 0 } },
+
+    -- Test decode_keep_buffer()
+    { "Set decode_keep_buffer(false)",
+      json.decode_keep_buffer, { false }, true, { false, 1048576 } },
+    { "Decode escaped string without keep buffer",
+      json.decode, { '["a\\tb", "c\\nd"]' }, true, { { "a\tb", "c\nd" } } },
+    { "Set decode_keep_buffer(true, 16)",
+      json.decode_keep_buffer, { true, 16 }, true, { true, 16 } },
+    { "Decode escaped string over the buffer limit",
+      json.decode, { '"' .. string.rep("\\u0041", 20) .. '"' },
+      true, { string.rep("A", 20) } },
+    { "Decode escaped string after trimming the buffer",
+      json.decode, { '"' .. string.rep("\\u0042", 20) .. '"' },
+      true, { string.rep("B", 20) } },
+    { "Decode invalid escape with keep buffer [throw error]",
+      json.decode, { '"\\z"' },
+      false, { "Expected value but found invalid escape code at character 2" } },
+    { "Decode buffer trimmed to the limit",
+      function () return json.buffer_stats().decode.size end,
+      { }, true, { 17 } },
+    { "Set decode_keep_buffer(true, 1048576)",
+      json.decode_keep_buffer, { true, 1048576 }, true, { true, 1048576 } },
+    { "Keep decode buffer after a finalizer error",
+      function ()
+          -- Lua 5.1 - 5.3 raise finalizer errors from the allocation
+          -- which ran the collector, unwinding the decode while it
+          -- holds the kept buffer. Lua 5.4 only issues a warning.
+          local text = "[" .. string.rep('"a\\nb",', 20000) .. "1]"
+          local function garbage()
+              local mt = { __gc = function () error("finalizer", 0) end }
+              if newproxy then
+                  getmetatable(newproxy(true)).__gc = mt.__gc
+              else
+                  setmetatable({}, mt)
+              end
+          end
+          -- Run a complete cycle at every allocation, so the garbage is
+          -- collected by the first allocation made by the decode. Its
+          -- stack is discarded with the coroutine.
+          local pause = collectgarbage("setpause", 0)
+          local stepmul = collectgarbage("setstepmul", 1000000)
+          collectgarbage()
+          coroutine.wrap(garbage)()
+          local ok, err = pcall(json.decode, text)
+          collectgarbage("setpause", pause)
+          collectgarbage("setstepmul", stepmul)
+          json.decode('"' .. string.rep("\\u0041", 70000) .. '"')
+          return err == "finalizer" or ok and _VERSION >= "Lua 5.4",
+                 json.buffer_stats().decode.size > 70000
+      end, { }, true, { true, true } },
+    { "Buffer stats without a kept buffer",
+      function ()
+          json.decode_keep_buffer(false)
+          local stats = json.buffer_stats().decode
+          json.decode_keep_buffer(true)
+          return stats.size, stats.peak, stats.reallocs
+      end, { }, true, { 0, 0, 0 } },
 
     -- Test config API errors
     -- Function is listed as '?' due to pcall
     { "Set encode_number_precision(0) [throw error]",
       json.encode_number_precision, { 0 },
-      false, { "bad argument #1 to '?' (expected integer between 1 and 14)" } },
+      false, { "bad argument #1 to '?' (expected integer between 1 and 17)" } },
     { "Set encode_number_precision(\"five\") [throw error]",
       json.encode_number_precision, { "five" },
       false, { "bad argument #1 to '?' (number expected, got string)" } },
-    { "Set encode_keep_buffer(nil, true) [throw error]",
-      json.encode_keep_buffer, { nil, true },
-      false, { "bad argument #2 to '?' (found too many arguments)" } },
+    { "Set encode_keep_buffer(nil, nil, nil, true) [throw error]",
+      json.encode_keep_buffer, { nil, nil, nil, true },
+      false, { "bad argument #4 to '?' (found too many arguments)" } },
+    { "Set encode_keep_buffer(true, -1) [throw error]",
+      json.encode_keep_buffer, { true, -1 },
+      false, { "bad argument #2 to '?' (expected integer between 0 and 2147483647)" } },
+    { "Set decode_keep_buffer(true, -1) [throw error]",
+      json.decode_keep_buffer, { true, -1 },
+      false, { "bad argument #2 to '?' (expected integer between 0 and 2147483647)" } },
     { "Set encode_max_depth(\"wrong\") [throw error]",
       json.encode_max_depth, { "wrong" },
       false, { "bad argument #1 to '?' (number expected, got string)" } },
@@ -422,6 +950,8 @@ util.run_test_group(cjson_tests)
 for _, filename in ipairs(arg) do
     util.run_test("Decode cycle " .. filename, test_decode_cycle, { filename },
                   true, { true })
+    util.run_test("Decode file " .. filename, test_decode_file, { filename },
+                  true, { true })
 end
 
 local pass, total = util.run_test_summary()